@@ -30,7 +30,6 @@
 
 #include "ns.h"
 #include "nsdb.h"
-#include "nsodbc.h"
 #define DONT_TD_VOID 1
 
 #ifndef REDBRICK
@@ -56,6 +55,12 @@
 #include <rbsqlext.h>
 #endif
 
+#include "nsodbc.h"
+
+#ifndef _WIN32
+# include <sys/mman.h>
+#endif
+
 #define RC_OK(rc) (!((rc)>>1))
 #define MAX_ERROR_MSG 500
 #define MAX_IDENTIFIER 256
@@ -71,13 +76,216 @@ static int             ODBCGetRow(Ns_DbHandle *handle, Ns_Set *row);
 static Ns_ReturnCode   ODBCCancel(Ns_DbHandle *handle);
 static int             ODBCExec(Ns_DbHandle *handle, const char *sql);
 static Ns_Set *        ODBCBindRow(Ns_DbHandle *handle);
+static Ns_ReturnCode   ODBCResetHandle(Ns_DbHandle *handle);
 static int         ODBCFreeStmt(Ns_DbHandle *handle);
 static void        ODBCLog(RETCODE rc, Ns_DbHandle *handle);
+static void        ODBCAddParam(OdbcConn *connPtr, const char *value);
+static SQLRETURN   ODBCBindParams(Ns_DbHandle *handle);
+static SQLRETURN   ODBCCachedStmt(Ns_DbHandle *handle, const char *sql);
+static SQLRETURN   ODBCPrepareStmt(Ns_DbHandle *handle, const char *sql);
+static SQLRETURN   ODBCExecChunk(Ns_DbHandle *handle, int nparams, int nrows,
+                                 const char **values, const size_t *sizes, char quote,
+                                 SQLUSMALLINT *status);
+static size_t      ODBCCopyField(char *dest, const char *value, size_t size, char quote);
+static void        ODBCLinkStmt(OdbcConn *connPtr, OdbcStmt *stmtPtr);
+static void        ODBCUnlinkStmt(OdbcConn *connPtr, const OdbcStmt *stmtPtr);
+static void        ODBCDropStmt(OdbcConn *connPtr, OdbcStmt *stmtPtr);
+static void        ODBCNormalizeSql(const char *sql, Ns_DString *dsPtr);
+static OdbcPool   *ODBCGetPool(const char *poolname);
+static bool        ODBCBindColumns(Ns_DbHandle *handle, bool allowBlock);
+static bool        ODBCDescribeColumns(Ns_DbHandle *handle);
+static void        ODBCResetColumns(OdbcConn *connPtr);
+static Tcl_Obj    *ODBCColumnsObj(const OdbcConn *connPtr);
+static SQLRETURN   ODBCGetData(Ns_DbHandle *handle, SQLUSMALLINT i, SQLSMALLINT cType,
+                               const char **valuePtr, SQLLEN *lengthPtr);
+static SQLRETURN   ODBCGetObj(Ns_DbHandle *handle, SQLUSMALLINT i, Tcl_Obj **objPtr);
+static Ns_ReturnCode ODBCFetch(Ns_DbHandle *handle);
+static bool        ODBCColumnValue(Ns_DbHandle *handle, SQLUSMALLINT i,
+                                   const char **valuePtr, SQLLEN *lengthPtr);
 static const char *odbcName = "ODBC";
-static HENV        odbcenv;
+static OdbcEnv     sharedEnv;
+
+/*
+ * Server-wide cache of parsed bind variable templates, split into
+ * stripes with separate locks.
+ */
+
+#define TEMPLATE_STRIPES 16
+
+/*
+ * Max. number of fingerprints aggregated per pool by the slow query log.
+ */
+
+#define ODBC_MAX_SLOW_QUERIES 1000
+
+typedef struct TemplateStripe {
+    Ns_Mutex      lock;
+    Tcl_HashTable table;
+    int           size;
+} TemplateStripe;
+
+static TemplateStripe templateStripes[TEMPLATE_STRIPES];
+static int            templateCacheSize;
+
+static Tcl_HashTable poolsTable;
+static Ns_Mutex      poolsLock;
+
+/*
+ * Calls of statements with a query timeout, watched by the watchdog
+ * thread which cancels them when their deadline has passed.
+ */
+
+#define WATCHDOG_GRACE 2              /* Seconds left to the driver's timeout */
+
+static struct {
+    Ns_Mutex      lock;
+    Ns_Cond       cond;
+    OdbcConn     *firstPtr;
+    Ns_Time       wakeup;             /* Next check, zero when idle */
+    bool          running;
+    bool          shutdown;
+} watchdog;
+
+/*
+ * Jobs of "ns_odbc exec -async" and the worker threads running them.
+ */
+
+static struct {
+    Ns_Mutex      lock;
+    Ns_Cond       queueCond;          /* Signaled on new jobs and shutdown */
+    Ns_Cond       doneCond;           /* Signaled on finished jobs and exits */
+    Tcl_HashTable jobs;               /* Jobs not yet collected, by id */
+    OdbcJob      *firstPtr;           /* Queue of pending jobs */
+    OdbcJob      *lastPtr;
+    unsigned long nextId;
+    Ns_Time       resultTimeout;      /* Lifetime of uncollected results */
+    Ns_Time       nextSweep;
+    Ns_Thread    *threads;
+    int           maxThreads;
+    int           numStarted;
+    int           numThreads;
+    int           numIdle;
+    bool          shutdown;
+} async;
+
+/*
+ * Results of "ns_odbc_bind 1row|0or1row -cache", keyed by pool name and
+ * the SQL after bind variable substitution. Values are Ns_Sets.
+ */
+
+static Ns_Cache *resultCache;
+
+/*
+ * Queries of "ns_odbc_bind 1row|0or1row -coalesce" in progress, keyed
+ * like the result cache.
+ */
+
+static struct {
+    Ns_Mutex      lock;
+    Tcl_HashTable table;          /* OdbcFlight by pool and SQL */
+} flights;
+
+/*
+ * Startup warm-up: the threads opening handles wait for each other
+ * before returning them, so that every one opens a different handle.
+ */
+
+static struct {
+    Ns_Mutex      lock;
+    Ns_Cond       cond;
+    int           numThreads;
+    int           numDone;
+    int           numOpened;
+} warmup;
+
+/*
+ * Routes by name, set up at driver initialization and read-only
+ * afterwards. The sticky windows are kept per thread, as an array
+ * indexed by route.
+ */
+
+static Tcl_HashTable routesTable;
+static int           numRoutes;
+static Ns_Tls        stickyTls;
 
 static Tcl_CmdProc ODBCCmd;
 static Tcl_CmdProc ODBCBindCmd;
+static int         ODBCBatchDMLCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCCachedRowCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCRunRow(Tcl_Interp *interp, Ns_DbHandle *handle, const char *cmd,
+                              const char *query, const Ns_Set *set, Ns_Set **rowPtrPtr,
+                              int *nrowsPtr);
+static void        ODBCFreeFlight(OdbcFlight *flightPtr);
+static Ns_DbHandle *ODBCPoolGetHandle(Tcl_Interp *interp, const char *pool);
+static void        ODBCHandleTimeout(const char *pool, Ns_Time *timePtr);
+static OdbcEnv    *ODBCNewEnv(const char *name, SQLULEN cpMatch);
+static SQLRETURN   ODBCConnect(Ns_DbHandle *handle, SQLHDBC hdbc);
+static void        ODBCAppendAttribute(Ns_DString *dsPtr, const char *key, const char *value);
+static bool        ODBCConnectionDead(const Ns_DbHandle *handle);
+static bool        ODBCLinkFailure(const Ns_DbHandle *handle);
+static bool        ODBCIsRead(const char *sql);
+static bool        ODBCReconnect(Ns_DbHandle *handle);
+static int         ODBCAliveCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static bool        ODBCInitSession(Ns_DbHandle *handle);
+static Ns_Callback ODBCWarmup;
+static Ns_ThreadProc ODBCWarmupThread;
+static void        ODBCEnvEnter(OdbcEnv *envPtr);
+static void        ODBCEnvLeave(OdbcEnv *envPtr, const Ns_Time *startPtr);
+static SQLRETURN   ODBCAllocStmt(const OdbcConn *connPtr, SQLHSTMT *hstmtPtr);
+static SQLRETURN   ODBCDropHstmt(const OdbcConn *connPtr, SQLHSTMT hstmt);
+static Tcl_Obj    *ODBCEnvObj(OdbcEnv *envPtr, bool reset);
+static Tcl_WideInt ODBCAtomicAdd(Tcl_WideInt *counterPtr, Tcl_WideInt n);
+static void        ODBCAtomicMax(Tcl_WideInt *counterPtr, Tcl_WideInt value);
+static Tcl_WideInt ODBCAtomicGet(Tcl_WideInt *counterPtr, bool reset);
+static void        ODBCRoutesInit(const char *configPath);
+static OdbcRoute  *ODBCGetRoute(const char *name);
+static const char *ODBCRoutePool(const OdbcRoute *routePtr, bool write, bool *stickyPtr);
+static OdbcSticky *ODBCStickyWindow(const OdbcRoute *routePtr, uintptr_t *connIdPtr);
+static void        ODBCMarkWrite(const char *pool);
+static int         ODBCRoutedCmd(Tcl_Interp *interp, int argc, const char *argv[],
+                                 const OdbcRoute *routePtr);
+static int         ODBCRouteCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCCacheCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static Ns_FreeProc ODBCFreeCachedRow;
+static int         ODBCQueryCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCForeachCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCJsonCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCCopyOutCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCLoadCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCAsyncExecCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCAsyncWaitCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCParallelCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static void        ODBCRunJob(OdbcJob *jobPtr, Ns_DbHandle *handle);
+static void        ODBCRunJobs(OdbcParallel *parPtr, Ns_DbHandle *handle);
+static int         ODBCJobResult(Tcl_Interp *interp, OdbcJob *jobPtr);
+static void        ODBCFreeJob(OdbcJob *jobPtr);
+static void        ODBCSweepJobs(const Ns_Time *nowPtr);
+static Ns_ThreadProc ODBCAsyncThread;
+static Ns_ThreadProc ODBCParallelThread;
+static Ns_ThreadProc ODBCWatchdogThread;
+static int         ODBCTimeoutCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCTransactionCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static SQLRETURN   ODBCBeginTran(Ns_DbHandle *handle);
+static SQLRETURN   ODBCEndTran(Ns_DbHandle *handle, SQLSMALLINT completion);
+static int         ODBCQueryTimeout(const OdbcConn *connPtr);
+static void        ODBCWatchStmt(Ns_DbHandle *handle);
+static void        ODBCUnwatchStmt(OdbcConn *connPtr);
+static void        ODBCWatchCall(OdbcConn *connPtr);
+static int         ODBCStatsCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static void        ODBCStatsInit(OdbcStats *statsPtr);
+static void        ODBCStatsReset(OdbcStats *statsPtr);
+static void        ODBCStatsMerge(OdbcConn *connPtr);
+static Tcl_Obj    *ODBCStatsObj(const OdbcStats *statsPtr);
+static void        ODBCPhaseDone(OdbcConn *connPtr, OdbcPhase phase, const Ns_Time *startPtr);
+static SQLRETURN   ODBCSQLFetch(Ns_DbHandle *handle);
+static RETCODE     ODBCExecute(Ns_DbHandle *handle, const char *sql);
+static SQLRETURN   ODBCFetchRowsObj(Ns_DbHandle *handle, bool dicts, Tcl_Obj *nullObj,
+                                    Tcl_Obj *listObj);
+static int         ODBCResultsCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static int         ODBCSlowQueriesCmd(Tcl_Interp *interp, int argc, const char *argv[]);
+static void        ODBCFingerprint(const char *sql, Ns_DString *dsPtr);
+static void        ODBCLogSlowQuery(Ns_DbHandle *handle);
+static int         ODBCGetHandle(Tcl_Interp *interp, const char *id, Ns_DbHandle **handlePtr);
 static Ns_TclTraceProc AddCmds;
 
 NS_EXPORT NsDb_DriverInitProc Ns_DbDriverInit;
@@ -93,6 +301,7 @@ static Ns_DbProc odbcProcs[] = {
     {DbFn_Cancel,     (ns_funcptr_t)ODBCCancel},
     {DbFn_Exec,       (ns_funcptr_t)ODBCExec},
     {DbFn_BindRow,    (ns_funcptr_t)ODBCBindRow},
+    {DbFn_ResetHandle, (ns_funcptr_t)ODBCResetHandle},
     {0, NULL}
 };
 
@@ -116,17 +325,74 @@ static Ns_DbProc odbcProcs[] = {
 NS_EXPORT int   Ns_ModuleVersion = 1;
 
 NS_EXPORT Ns_ReturnCode
-Ns_DbDriverInit(const char *driver, const char *UNUSED(configPath))
+Ns_DbDriverInit(const char *driver, const char *configPath)
 {
-    if (SQLAllocEnv(&odbcenv) != SQL_SUCCESS) {
+    const char *pooling;
+    int         i;
+
+    /*
+     * Connection pooling of the driver manager is a process wide
+     * setting, which must be made before any environment is allocated.
+     */
+    pooling = Ns_ConfigString(configPath, "connectionpooling", "off");
+    if (!STREQ(pooling, "off")) {
+        SQLULEN value = STREQ(pooling, "environment") ? SQL_CP_ONE_PER_HENV
+            : SQL_CP_ONE_PER_DRIVER;
+
+        if (!STREQ(pooling, "driver") && !STREQ(pooling, "environment")) {
+            Ns_Log(Warning, "%s: invalid connectionpooling \"%s\", using \"driver\"",
+                   driver, pooling);
+        }
+        if (!RC_OK(SQLSetEnvAttr(SQL_NULL_HENV, SQL_ATTR_CONNECTION_POOLING,
+                                 (SQLPOINTER)value, 0))) {
+            Ns_Log(Warning, "%s: could not enable connection pooling", driver);
+        }
+    }
+    /*
+     * The shared environment keeps the ODBC 2 behavior of earlier
+     * versions (SQLSTATEs, date and time type codes), which existing
+     * applications may depend on. Pools with an own environment
+     * ("environment") get ODBC 3 behavior.
+     */
+    if (SQLAllocEnv(&sharedEnv.henv) != SQL_SUCCESS) {
         Ns_Log(Error, "%s: failed to allocate odbc", driver);
         return NS_ERROR;
     }
+    Tcl_InitHashTable(&poolsTable, TCL_STRING_KEYS);
+    Ns_MutexSetName2(&poolsLock, "nsodbc", "pools");
+
+    templateCacheSize = Ns_ConfigIntRange(configPath, "templatecachesize",
+                                          1000, 0, INT_MAX) / TEMPLATE_STRIPES;
+    for (i = 0; i < TEMPLATE_STRIPES; i++) {
+        Tcl_InitHashTable(&templateStripes[i].table, TCL_STRING_KEYS);
+        Ns_MutexSetName2(&templateStripes[i].lock, "nsodbc", "templates");
+    }
+    async.maxThreads = Ns_ConfigIntRange(configPath, "asyncthreads", 4, 1, INT_MAX);
+    async.threads = ns_calloc((size_t)async.maxThreads, sizeof(Ns_Thread));
+    (void) Ns_ConfigTimeUnitRange(configPath, "asyncresulttimeout", "5m", 1, 0,
+                                  INT_MAX, 0, &async.resultTimeout);
+    Tcl_InitHashTable(&async.jobs, TCL_STRING_KEYS);
+    Ns_MutexSetName2(&async.lock, "nsodbc", "async");
+    Ns_CondInit(&async.queueCond);
+    Ns_CondInit(&async.doneCond);
+    Ns_MutexSetName2(&watchdog.lock, "nsodbc", "watchdog");
+    Ns_CondInit(&watchdog.cond);
+    ODBCRoutesInit(configPath);
+    Tcl_InitHashTable(&flights.table, TCL_STRING_KEYS);
+    Ns_MutexSetName2(&flights.lock, "nsodbc", "flights");
+    resultCache = Ns_CacheCreateSz("nsodbc:results", TCL_STRING_KEYS,
+                                   (size_t)Ns_ConfigMemUnitRange(configPath, "resultcachesize",
+                                                                 "10MB", 10 * 1024 * 1024,
+                                                                 0, INT_MAX),
+                                   ODBCFreeCachedRow);
     if (Ns_DbRegisterDriver(driver, odbcProcs) != NS_OK) {
         Ns_Log(Error, "%s: failed to register driver", driver);
         return NS_ERROR;
     }
-    Ns_RegisterAtShutdown(ODBCShutdown, odbcenv);
+    Ns_MutexSetName2(&warmup.lock, "nsodbc", "warmup");
+    Ns_CondInit(&warmup.cond);
+    Ns_RegisterAtStartup(ODBCWarmup, NULL);
+    Ns_RegisterAtShutdown(ODBCShutdown, NULL);
     return NS_OK;
 }
 
@@ -172,7 +438,8 @@ BadArgs(Tcl_Interp *interp, const char **argv, const char *args)
  *      Return TCL_ERROR and set database failure message as Tcl result.
  *
  * Side effects:
- *      None.
+ *      Drops "nativebind" parameters not consumed by a statement,
+ *      which would otherwise be bound by the next one of the handle.
  *
  *----------------------------------------------------------------------
  */
@@ -180,6 +447,9 @@ BadArgs(Tcl_Interp *interp, const char **argv, const char *args)
 static int
 DbFail(Tcl_Interp *interp, Ns_DbHandle *handle, const char *cmd, char* sql)
 {
+  if (handle->connection != NULL) {
+    ((OdbcConn *)handle->connection)->numParams = 0;
+  }
 
   Tcl_AppendResult(interp, "Database operation \"", cmd, "\" failed", NULL);
   if (handle->cExceptionCode[0] != '\0') {
@@ -205,194 +475,403 @@ DbFail(Tcl_Interp *interp, Ns_DbHandle *handle, const char *cmd, char* sql)
 
 
 /*
- * utility functions for dealing with string lists
+ *----------------------------------------------------------------------
+ * ODBCGetHandle --
+ *
+ *      Get the handle with the given id and make sure it is a connected
+ *      handle of this driver.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      Exception code and message of the handle are reset.
+ *
+ *----------------------------------------------------------------------
  */
 
-static string_list_elt_t *
-string_list_elt_new(char *string)
-{
-  string_list_elt_t *elt =
-    (string_list_elt_t *) ns_malloc(sizeof(string_list_elt_t));
-  elt->string = string;
-  elt->next = 0;
-
-  return elt;
-
-} /* string_list_elt_new */
-
-
-
 static int
-string_list_len (string_list_elt_t *head)
+ODBCGetHandle(Tcl_Interp *interp, const char *id, Ns_DbHandle **handlePtr)
 {
-  int i = 0;
-
-  while (head != NULL) {
-    i++;
-    head = head->next;
-  }
+    Ns_DbHandle *handle;
 
-  return i;
+    if (Ns_TclDbGetHandle(interp, id, &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (Ns_DbDriverName(handle) != odbcName) {
+        Tcl_AppendResult(interp, "handle \"", id, "\" is not of type \"",
+                         odbcName, "\"", NULL);
+        return TCL_ERROR;
+    }
+    if (handle->connection == NULL) {
+        Tcl_AppendResult(interp, "handle \"", id, "\" not connected", NULL);
+        return TCL_ERROR;
+    }
+    Ns_DStringFree(&handle->dsExceptionMsg);
+    handle->cExceptionCode[0] = '\0';
+    *handlePtr = handle;
 
-} /* string_list_len */
+    return TCL_OK;
+}
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCNextBindVar --
+ *
+ *      Find the next bind variable (":name") in an SQL string, skipping
+ *      quoted strings and "::" casts.
+ *
+ * Results:
+ *      Pointer to the colon of the bind variable or NULL, when there is
+ *      none. *endPtr is set to the first character after the name.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-/* Free the whole list and the strings in it. */
+#define BINDCHAR(c) ((c) == '_' || (c) == '$' || (c) == '#' || CHARTYPE(alnum, (c)) != 0)
 
-static void
-string_list_free_list (string_list_elt_t *head)
+static const char *
+ODBCNextBindVar(const char *p, const char **endPtr)
 {
-  string_list_elt_t *elt;
+    bool instr = NS_FALSE;
+    char lastchar = '\0';
 
-  while (head) {
-    ns_free(head->string);
-    elt = head->next;
-    ns_free(head);
-    head = elt;
-  }
+    for (; *p != '\0'; lastchar = *p, p++) {
+        if (instr) {
+            if (*p == '\'') {
+                instr = NS_FALSE;
+            }
+        } else if (*p == '\'') {
+            instr = NS_TRUE;
+        } else if (*p == ':' && lastchar != ':' && BINDCHAR(*(p + 1))) {
+            const char *q = p + 1;
+
+            while (BINDCHAR(*q)) {
+                q++;
+            }
+            *endPtr = q;
+            return p;
+        }
+    }
+    return NULL;
+}
 
-} /* string_list_free_list */
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCParseTemplate --
+ *
+ *      Parse an SQL string into an immutable template, consisting of the
+ *      SQL fragments between the bind variables and the variable names.
+ *      The template is allocated as a single block.
+ *
+ * Results:
+ *      Pointer to new template.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
+static OdbcTemplate *
+ODBCParseTemplate(const char *sql)
+{
+    OdbcTemplate *tmplPtr;
+    const char   *p, *start, *end;
+    char         *text, *names;
+    size_t        len = strlen(sql), size;
+    int           n = 0;
+
+    for (p = sql; (start = ODBCNextBindVar(p, &end)) != NULL; p = end) {
+        n++;
+    }
+    size = sizeof(OdbcTemplate)
+        + (size_t)(n + 1) * sizeof(OdbcFragment)
+        + (size_t)n * sizeof(char *)
+        + len + 1u + len + 1u;
+    tmplPtr = ns_malloc(size);
+    tmplPtr->numVars = n;
+    tmplPtr->cached = NS_FALSE;
+    tmplPtr->fragments = (OdbcFragment *)(void *)(tmplPtr + 1);
+    tmplPtr->varNames = (const char **)(void *)(tmplPtr->fragments + n + 1);
+    text = (char *)(tmplPtr->varNames + n);
+    memcpy(text, sql, len + 1u);
+    tmplPtr->text = text;
+    names = text + len + 1u;
+
+    n = 0;
+    for (p = text; (start = ODBCNextBindVar(p, &end)) != NULL; p = end) {
+        tmplPtr->fragments[n].offset = (size_t)(p - text);
+        tmplPtr->fragments[n].length = (size_t)(start - p);
+        memcpy(names, start + 1, (size_t)(end - start - 1));
+        names[end - start - 1] = '\0';
+        tmplPtr->varNames[n] = names;
+        names += end - start;
+        n++;
+    }
+    tmplPtr->fragments[n].offset = (size_t)(p - text);
+    tmplPtr->fragments[n].length = strlen(p);
 
+    return tmplPtr;
+}
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCGetTemplate --
+ *
+ *      Return the bind variable template of an SQL string. Templates
+ *      are kept in a server-wide cache, split into stripes with their
+ *      own locks to reduce contention. When the cache is full, the
+ *      template is created for this call only.
+ *
+ * Results:
+ *      Pointer to template, to be released with ODBCReleaseTemplate.
+ *
+ * Side effects:
+ *      May add the template to the cache.
+ *
+ *----------------------------------------------------------------------
+ */
 
+static OdbcTemplate *
+ODBCGetTemplate(const char *sql)
+{
+    OdbcTemplate   *tmplPtr;
+    TemplateStripe *stripePtr;
+    Tcl_HashEntry  *hPtr;
+    const char     *p;
+    unsigned int    hash = 0u;
+    int             isNew;
+
+    for (p = sql; *p != '\0'; p++) {
+        hash += (hash << 3) + (unsigned char)*p;
+    }
+    stripePtr = &templateStripes[hash % TEMPLATE_STRIPES];
+
+    Ns_MutexLock(&stripePtr->lock);
+    hPtr = Tcl_FindHashEntry(&stripePtr->table, sql);
+    tmplPtr = (hPtr != NULL) ? Tcl_GetHashValue(hPtr) : NULL;
+    Ns_MutexUnlock(&stripePtr->lock);
+    if (tmplPtr != NULL) {
+        return tmplPtr;
+    }
 
+    tmplPtr = ODBCParseTemplate(sql);
+    if (templateCacheSize > 0) {
+        Ns_MutexLock(&stripePtr->lock);
+        if (stripePtr->size < templateCacheSize) {
+            hPtr = Tcl_CreateHashEntry(&stripePtr->table, sql, &isNew);
+            if (isNew != 0) {
+                tmplPtr->cached = NS_TRUE;
+                Tcl_SetHashValue(hPtr, tmplPtr);
+                stripePtr->size++;
+            } else {
+                /*
+                 * Added concurrently by another thread.
+                 */
+                ns_free(tmplPtr);
+                tmplPtr = Tcl_GetHashValue(hPtr);
+            }
+        }
+        Ns_MutexUnlock(&stripePtr->lock);
+    }
+    return tmplPtr;
+}
 
+static void
+ODBCReleaseTemplate(OdbcTemplate *tmplPtr)
+{
+    if (!tmplPtr->cached) {
+        ns_free(tmplPtr);
+    }
+}
 
 
-/* Parse a SQL string and return a list of all
- * the bind variables found in it.
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCBindSubstitute --
+ *
+ *      Rebuild the query of a template in a single pass, substituting
+ *      the values of the bind variables, taken from the Tcl variables
+ *      of the caller or from the given set. With "nativebind", the
+ *      variables are replaced by "?" and the values are collected as
+ *      parameters of the handle instead.
+ *
+ * Results:
+ *      Tcl result code. The query is appended to dsPtr.
+ *
+ * Side effects:
+ *      Sets an error message in interp for undefined variables; the
+ *      parameters collected so far are dropped then.
+ *
+ *----------------------------------------------------------------------
  */
 
-static void
-parse_odbc_bind_variables(char *input,
-                     string_list_elt_t **bind_variables,
-                     string_list_elt_t **fragments)
-{
-  char *p, lastchar;
-  enum { base, instr, bind } state;
-  char *bindbuf, *bp;
-  char *fragbuf, *fp;
-  string_list_elt_t *elt, *head=0, *tail=0;
-  string_list_elt_t *felt, *fhead=0, *ftail=0;
-  int current_string_length = 0;
-
-  fragbuf = (char*)ns_malloc((strlen(input)+1)*sizeof(char));
-  fp = fragbuf;
-  bindbuf = (char*)ns_malloc((strlen(input)+1)*sizeof(char));
-  bp = bindbuf;
-
-  for (p = input, state=base, lastchar='\0'; *p != '\0'; lastchar = *p, p++) {
-
-    switch (state) {
-    case base:
-      if (*p == '\'') {
-        state = instr;
-        current_string_length = 0;
-        *fp++ = *p;
-      } else if ((*p == ':') && (*(p + 1) != ':') && (lastchar != ':')) {
-        bp = bindbuf;
-        state = bind;
-        *fp = '\0';
-        felt = string_list_elt_new(ns_strdup(fragbuf));
-        if(ftail == 0) {
-          fhead = ftail = felt;
-        } else {
-          ftail->next = felt;
-          ftail = felt;
-        }
-      } else {
-        *fp++ = *p;
-      }
-      break;
+static int
+ODBCBindSubstitute(Tcl_Interp *interp, const OdbcTemplate *tmplPtr, const Ns_Set *set,
+                   OdbcConn *connPtr, Ns_DString *dsPtr)
+{
+  bool        nativeBind;
+  const char *value, *p;
+  int         i;
 
-    case instr:
-      if (*p == '\'' && (lastchar != '\'' || current_string_length == 0)) {
-        state = base;
-      }
-      current_string_length++;
-      *fp++ = *p;
-      break;
+  nativeBind = (connPtr != NULL && connPtr->poolPtr->nativeBind);
+  if (connPtr != NULL) {
+    connPtr->numParams = 0;
+  }
 
-    case bind:
-      if (*p == '=') {
-        state = base;
-        bp = bindbuf;
-        fp = fragbuf;
-      } else if (!(*p == '_' || *p == '$' || *p == '#' || isalnum((int)*p))) {
-        *bp = '\0';
-        elt = string_list_elt_new(ns_strdup(bindbuf));
-        if (tail == 0) {
-          head = tail = elt;
-        } else {
-          tail->next = elt;
-          tail = elt;
-        }
-        state = base;
-        fp = fragbuf;
-        p--;
-      } else {
-        *bp++ = *p;
-      }
+  for (i = 0; i <= tmplPtr->numVars; i++) {
+    Ns_DStringNAppend(dsPtr, tmplPtr->text + tmplPtr->fragments[i].offset,
+                      (int)tmplPtr->fragments[i].length);
+    if (i == tmplPtr->numVars) {
       break;
     }
-  }
 
-  if (state == bind) {
-    *bp = '\0';
-    elt = string_list_elt_new(ns_strdup(bindbuf));
-    if (tail == 0) {
-      head = tail = elt;
+    if (set == NULL) {
+      value = Tcl_GetVar(interp, tmplPtr->varNames[i], 0);
     } else {
-      tail->next = elt;
-      tail = elt;
+      value = Ns_SetGet(set, tmplPtr->varNames[i]);
     }
-  } else {
-    *fp = '\0';
-    felt = string_list_elt_new(ns_strdup(fragbuf));
-    if (ftail == 0) {
-      fhead = ftail = felt;
+    if (value == NULL) {
+      Tcl_AppendResult (interp, "undefined variable `", tmplPtr->varNames[i],
+                        "'", NULL);
+      if (connPtr != NULL) {
+        connPtr->numParams = 0;
+      }
+      return TCL_ERROR;
+    }
+
+    if (nativeBind) {
+        /*
+         * Pass the value separately from the statement text, such
+         * that the statement can be prepared once by the database.
+         */
+        Ns_DStringAppend(dsPtr, "?");
+        ODBCAddParam(connPtr, value);
+    } else if ( strlen(value) == 0 ) {
+        /*
+         * DRB: If the Tcl variable contains the empty string, pass a NULL
+         * as the value.
+         */
+        Ns_DStringAppend(dsPtr, "NULL");
     } else {
-      ftail->next = felt;
-      ftail = felt;
+        /*
+         * DRB: We really only need to quote strings, but there is one benefit
+         * to quoting numeric values as well.  A value like '35 union select...'
+         * substituted for a legitimate value in a URL to "smuggle" SQL into a
+         * script will cause a string-to-integer conversion error within Postgres.
+         * This conversion is done before optimization of the query, so indices are
+         * still used when appropriate.
+         */
+        Ns_DStringAppend(dsPtr, "'");
+
+        /*
+         * DRB: Unfortunately, we need to double-quote quotes as well ... and
+         * escape backslashes
+         */
+        for (p = value; *p; p++) {
+            if (*p == '\'') {
+                if (p > value) {
+                    Ns_DStringNAppend(dsPtr, value, (int)(p-value));
+                }
+                value = p;
+                Ns_DStringAppend(dsPtr, "'");
+            } else if (*p == '\\') {
+                if (p > value) {
+                    Ns_DStringNAppend(dsPtr, value, (int)(p-value));
+                }
+                value = p;
+                Ns_DStringAppend(dsPtr, "\\");
+            }
+        }
+
+        if (p > value) {
+            Ns_DStringAppend(dsPtr, value);
+        }
+
+        Ns_DStringAppend(dsPtr, "'");
     }
   }
 
-  ns_free(fragbuf);
-  ns_free(bindbuf);
-  *bind_variables = head;
-  *fragments      = fhead;
+  return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCBindQuery --
+ *
+ *      Get the parsed form of the query string (fragments and bind
+ *      variables) and rebuild the query with the bind variable values
+ *      interpolated into the original query (or passed as parameters
+ *      with "nativebind").
+ *
+ * Results:
+ *      Query to be freed with ns_free, or NULL on error.
+ *
+ * Side effects:
+ *      Sets an error message in interp for undefined variables.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char *
+ODBCBindQuery(Tcl_Interp *interp, Ns_DbHandle *handle, const char *query, const Ns_Set *set)
+{
+    OdbcTemplate *tmplPtr;
+    Ns_DString    ds;
+    char         *sql = NULL;
 
-  return;
+    tmplPtr = ODBCGetTemplate(query);
+    Ns_DStringInit(&ds);
+    if (ODBCBindSubstitute(interp, tmplPtr, set, handle->connection, &ds) == TCL_OK) {
+        sql = Ns_DStringExport(&ds);
+    }
+    Ns_DStringFree(&ds);
+    ODBCReleaseTemplate(tmplPtr);
 
-} /* parse_odbc_bind_variables */
+    return sql;
+}
 
 
 /*
  * ODBCBindCMD - This function implements the "ns_odbc_bind" Tcl command
  * installed into each interpreter of each virtual server.  It provides
  * for the parsing and substitution of bind variables into the original
- * sql query.  This is an emulation only. Postgresql doesn't currently
- * support true bind variables yet.
+ * sql query.  By default, this is an emulation only.  When the pool is
+ * configured with "nativebind", the bind variables are replaced by "?"
+ * placeholders and the values are passed via SQLBindParameter instead.
  */
 
 static int
 ODBCBindCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const char *argv[]) {
 
-  string_list_elt_t *bind_variables;
-  string_list_elt_t *var_p;
-  string_list_elt_t *sql_fragments;
-  string_list_elt_t *frag_p;
-  Ns_DString         ds;
   Ns_DbHandle       *handle;
   Ns_Set            *rowPtr;
   Ns_Set            *set   = NULL;
-  const char        *cmd;
+  const char        *cmd, *query;
   char              *sql;
-  const char        *value = NULL, *p;
+
+  if (argc > 1 && STREQ(argv[1], "batchdml")) {
+    return ODBCBatchDMLCmd(interp, argc, argv);
+  }
+  if (argc > 2 && (STREQ(argv[2], "-cache") || STREQ(argv[2], "-coalesce"))) {
+    return ODBCCachedRowCmd(interp, argc, argv);
+  }
+  if (argc > 2 && ODBCGetRoute(argv[2]) != NULL) {
+    return ODBCRoutedCmd(interp, argc, argv, ODBCGetRoute(argv[2]));
+  }
 
   if (argc < 4 || (!STREQ("-bind", argv[3]) && (argc != 4)) ||
        (STREQ("-bind", argv[3]) && (argc != 6))) {
@@ -416,6 +895,12 @@ ODBCBindCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const c
     return TCL_ERROR;
                             }
   cmd = argv[1];
+  if (!STREQ(cmd, "dml") && !STREQ(cmd, "1row") && !STREQ(cmd, "0or1row")
+      && !STREQ(cmd, "select") && !STREQ(cmd, "exec")) {
+    Tcl_AppendResult(interp, "unknown command \"", cmd,
+                     "\": should be 0or1row, 1row, batchdml, dml, exec or select", NULL);
+    return TCL_ERROR;
+  }
 
   if (STREQ("-bind", argv[3])) {
     set = Ns_TclGetSet(interp, argv[4]);
@@ -423,107 +908,16 @@ ODBCBindCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const c
       Tcl_AppendResult (interp, "invalid set id `", argv[4], "'", NULL);
       return TCL_ERROR;
     }
-    sql = ns_strdup(argv[5]);
+    query = argv[5];
   } else {
-    sql = ns_strdup(argv[3]);
+    query = argv[3];
   }
 
-  /*
-   * Parse the query string and find the bind variables.  Return
-   * the sql fragments so that the query can be rebuilt with the
-   * bind variable values interpolated into the original query.
-   */
-
-  parse_odbc_bind_variables(sql, &bind_variables, &sql_fragments);
-
-  if (string_list_len(bind_variables) > 0) {
-
-    Ns_DStringInit(&ds);
-
-    /*
-     * Rebuild the query and substitute the actual tcl variable values
-     * for the bind variables.
-     */
-
-    for (var_p = bind_variables, frag_p = sql_fragments;
-         var_p != NULL || frag_p != NULL;) {
-
-      if (frag_p != NULL) {
-        Ns_DStringAppend(&ds, frag_p->string);
-        frag_p = frag_p->next;
-      }
-
-      if (var_p != NULL) {
-        if (set == NULL) {
-          value = Tcl_GetVar(interp, var_p->string, 0);
-        } else {
-          value = Ns_SetGet(set, var_p->string);
-        }
-        if (value == NULL) {
-          Tcl_AppendResult (interp, "undefined variable `", var_p->string,
-                            "'", NULL);
-          Ns_DStringFree(&ds);
-          string_list_free_list(bind_variables);
-          string_list_free_list(sql_fragments);
-          ns_free(sql);
-          return TCL_ERROR;
-        }
-
-        if ( strlen(value) == 0 ) {
-            /*
-             * DRB: If the Tcl variable contains the empty string, pass a NULL
-             * as the value.
-             */
-            Ns_DStringAppend(&ds, "NULL");
-        } else {
-            /*
-             * DRB: We really only need to quote strings, but there is one benefit
-             * to quoting numeric values as well.  A value like '35 union select...'
-             * substituted for a legitimate value in a URL to "smuggle" SQL into a
-             * script will cause a string-to-integer conversion error within Postgres.
-             * This conversion is done before optimization of the query, so indices are
-             * still used when appropriate.
-             */
-            Ns_DStringAppend(&ds, "'");
-
-            /*
-             * DRB: Unfortunately, we need to double-quote quotes as well ... and
-             * escape backslashes
-             */
-            for (p = value; *p; p++) {
-                if (*p == '\'') {
-                    if (p > value) {
-                        Ns_DStringNAppend(&ds, value, (int)(p-value));
-                    }
-                    value = p;
-                    Ns_DStringAppend(&ds, "'");
-                } else if (*p == '\\') {
-                    if (p > value) {
-                        Ns_DStringNAppend(&ds, value, (int)(p-value));
-                    }
-                    value = p;
-                    Ns_DStringAppend(&ds, "\\");
-                }
-            }
-
-            if (p > value) {
-                Ns_DStringAppend(&ds, value);
-            }
-
-            Ns_DStringAppend(&ds, "'");
-        }
-        var_p = var_p->next;
-      }
-    }
-
-    ns_free(sql);
-    sql = Ns_DStringExport(&ds);
-    Ns_DStringFree(&ds);
+  sql = ODBCBindQuery(interp, handle, query, set);
+  if (sql == NULL) {
+    return TCL_ERROR;
   }
 
-  string_list_free_list(bind_variables);
-  string_list_free_list(sql_fragments);
-
   if (STREQ(cmd, "dml")) {
     if (Ns_DbDML(handle, sql) != NS_OK) {
       return DbFail(interp, handle, cmd, sql);
@@ -568,8 +962,6 @@ ODBCBindCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const c
       break;
     }
 
-  } else {
-    return DbFail(interp, handle, cmd, sql);
   }
   ns_free(sql);
 
@@ -579,305 +971,6616 @@ ODBCBindCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const c
 /*
  *----------------------------------------------------------------------
  *
- * ODBCServerInit -
+ * ODBCCachedRowCmd --
  *
- *	Initialize the server when nsdb is ready.
+ *      Implements "ns_odbc_bind 1row|0or1row ?-cache ttl? ?-coalesce?
+ *      dbId|pool|route ?-bind setId? sql".
+ *
+ *      With "-cache", the row is looked up in the result cache by pool
+ *      and SQL after substitution of the bind variables; on a miss,
+ *      the query is run and its row is cached for "ttl".
+ *
+ *      With "-coalesce", a caller finding the same query of the same
+ *      pool already running in another thread waits for it and gets
+ *      a copy of its result instead of running it again. Nothing is
+ *      kept after completion. Handles in a transaction do not
+ *      coalesce, as they might not see their own changes.
+ *
+ *      With a pool or route name instead of a handle, a handle is
+ *      taken from the pool only when the query has to be run.
  *
  * Results:
- *	NS_OK or NS_ERROR.
+ *      Standard Tcl result; a new ns_set with a copy of the row, or
+ *      empty for "0or1row" without a row.
  *
  * Side effects:
- *	Adds ns_odbc command.
+ *      May fill the result cache.
  *
  *----------------------------------------------------------------------
  */
 
-static Ns_ReturnCode
-AddCmds(Tcl_Interp *interp, const void *UNUSED(arg))
+static int
+ODBCCachedRowCmd(Tcl_Interp *interp, int argc, const char *argv[])
 {
-    Tcl_CreateCommand(interp, "ns_odbc", ODBCCmd, NULL, NULL);
+    Ns_DbHandle    *handle = NULL;
+    const Ns_Set   *set = NULL;
+    Ns_Set         *rowPtr = NULL;
+    const char     *pool, *name, *server, *cmd = argv[1];
+    OdbcTemplate   *tmplPtr;
+    OdbcFlight     *flightPtr = NULL;
+    Tcl_HashEntry  *hPtr = NULL;
+    Ns_Entry       *entry;
+    Ns_DString      key;
+    Ns_Time         ttl, expires;
+    bool            cache = NS_FALSE, coalesce = NS_FALSE;
+    int             result = TCL_OK, nrows = 1, isNew, argi;
+    size_t          i, size;
+
+    for (argi = 2; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-cache") && argi + 1 < argc) {
+            Tcl_Obj *objPtr = Tcl_NewStringObj(argv[++argi], -1);
+
+            Tcl_IncrRefCount(objPtr);
+            result = Ns_TclGetTimeFromObj(interp, objPtr, &ttl);
+            Tcl_DecrRefCount(objPtr);
+            if (result != TCL_OK) {
+                return TCL_ERROR;
+            }
+            cache = NS_TRUE;
+        } else if (STREQ(argv[argi], "-coalesce")) {
+            coalesce = NS_TRUE;
+        } else {
+            break;
+        }
+    }
+    if ((argc - argi != 2 && argc - argi != 4)
+        || (argc - argi == 4 && !STREQ(argv[argi + 1], "-bind"))) {
+        return BadArgs(interp, argv,
+                       "?-cache ttl? ?-coalesce? dbId|pool|route ?-bind setId? sql");
+    }
+    if (!STREQ(cmd, "1row") && !STREQ(cmd, "0or1row")) {
+        Tcl_AppendResult(interp, "\"", argv[2], "\" is supported for 1row and 0or1row only",
+                         NULL);
+        return TCL_ERROR;
+    }
+    if (argc - argi == 4) {
+        set = Ns_TclGetSet(interp, argv[argi + 2]);
+        if (set == NULL) {
+            Tcl_AppendResult(interp, "invalid set id `", argv[argi + 2], "'", NULL);
+            return TCL_ERROR;
+        }
+    }
+
+    /*
+     * The database id is either a handle or a pool name.
+     */
+    if (Ns_TclDbGetHandle(interp, argv[argi], &handle) == TCL_OK) {
+        if (ODBCGetHandle(interp, argv[argi], &handle) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        pool = handle->poolname;
+        if (((OdbcConn *)handle->connection)->inTransaction) {
+            /*
+             * Uncommitted changes must neither be cached nor seen by
+             * other callers.
+             */
+            cache = coalesce = NS_FALSE;
+        }
+        name = pool;
+    } else {
+        OdbcRoute *routePtr = ODBCGetRoute(argv[argi]);
+
+        handle = NULL;
+        Tcl_ResetResult(interp);
+        name = pool = argv[argi];
+        if (routePtr != NULL) {
+            bool sticky;
+
+            /*
+             * Rows are cached and coalesced per route, except for
+             * reads from the write pool after a write, which must see
+             * the changes.
+             */
+            pool = ODBCRoutePool(routePtr, NS_FALSE, &sticky);
+            if (sticky) {
+                cache = coalesce = NS_FALSE;
+            }
+        }
+        server = Ns_TclInterpServer(interp);
+        if (server == NULL || !Ns_DbPoolAllowable(server, pool)) {
+            Tcl_AppendResult(interp, "invalid database id or pool: \"", argv[argi], "\"", NULL);
+            return TCL_ERROR;
+        }
+    }
+
+    /*
+     * The key is built with emulated bind variables, so that it
+     * contains the values also for "nativebind" pools.
+     */
+    Ns_DStringInit(&key);
+    Ns_DStringVarAppend(&key, name, " ", NULL);
+    tmplPtr = ODBCGetTemplate(argv[argc - 1]);
+    result = ODBCBindSubstitute(interp, tmplPtr, set, NULL, &key);
+    ODBCReleaseTemplate(tmplPtr);
+    if (result != TCL_OK) {
+        Ns_DStringFree(&key);
+        return TCL_ERROR;
+    }
+
+    if (cache) {
+        Ns_CacheLock(resultCache);
+        entry = Ns_CacheFindEntry(resultCache, key.string);
+        if (entry != NULL && Ns_CacheGetValue(entry) != NULL) {
+            rowPtr = Ns_SetCopy(Ns_CacheGetValue(entry));
+        }
+        Ns_CacheUnlock(resultCache);
+        if (rowPtr != NULL) {
+            goto done;
+        }
+    }
+
+    if (coalesce) {
+        Ns_MutexLock(&flights.lock);
+        hPtr = Tcl_CreateHashEntry(&flights.table, key.string, &isNew);
+        if (isNew == 0 && handle != NULL) {
+            /*
+             * A caller holding a handle never waits: the running query
+             * may itself be waiting for a handle of the same pool.
+             */
+            hPtr = NULL;
+            Ns_MutexUnlock(&flights.lock);
+        } else if (isNew == 0) {
+            /*
+             * Wait for the running query and take a copy of its
+             * result.
+             */
+            flightPtr = Tcl_GetHashValue(hPtr);
+            flightPtr->waiters++;
+            while (!flightPtr->done) {
+                Ns_CondWait(&flightPtr->cond, &flights.lock);
+            }
+            result = flightPtr->result;
+            nrows = flightPtr->nrows;
+            if (result != TCL_OK) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(flightPtr->error.string,
+                                                          flightPtr->error.length));
+            } else if (flightPtr->rowPtr != NULL) {
+                rowPtr = Ns_SetCopy(flightPtr->rowPtr);
+            }
+            if (--flightPtr->waiters == 0) {
+                ODBCFreeFlight(flightPtr);
+            }
+            Ns_MutexUnlock(&flights.lock);
+            goto done;
+        } else {
+            flightPtr = ns_calloc(1u, sizeof(OdbcFlight));
+            Ns_CondInit(&flightPtr->cond);
+            Ns_DStringInit(&flightPtr->error);
+            Tcl_SetHashValue(hPtr, flightPtr);
+            Ns_MutexUnlock(&flights.lock);
+        }
+    }
+
+    /*
+     * Run the query.
+     */
+    if (handle == NULL) {
+        handle = ODBCPoolGetHandle(interp, pool);
+        if (handle == NULL) {
+            result = TCL_ERROR;
+        } else {
+            result = ODBCRunRow(interp, handle, cmd, argv[argc - 1], set, &rowPtr, &nrows);
+            Ns_DbPoolPutHandle(handle);
+        }
+    } else {
+        result = ODBCRunRow(interp, handle, cmd, argv[argc - 1], set, &rowPtr, &nrows);
+    }
+
+    if (cache && result == TCL_OK && nrows > 0) {
+        size = sizeof(Ns_Set);
+        for (i = 0u; i < Ns_SetSize(rowPtr); i++) {
+            const char *value = Ns_SetValue(rowPtr, i);
+
+            size += strlen(Ns_SetKey(rowPtr, i)) + 1u
+                + ((value != NULL) ? strlen(value) + 1u : 0u);
+        }
+        Ns_CacheLock(resultCache);
+        entry = Ns_CacheCreateEntry(resultCache, key.string, &isNew);
+        Ns_CacheSetValueExpires(entry, Ns_SetCopy(rowPtr), size,
+                                Ns_AbsoluteTime(&expires, &ttl), 0);
+        Ns_CacheUnlock(resultCache);
+    }
+
+    if (flightPtr != NULL) {
+        /*
+         * Hand the result to the waiting callers.
+         */
+        Ns_MutexLock(&flights.lock);
+        Tcl_DeleteHashEntry(hPtr);
+        flightPtr->done = NS_TRUE;
+        flightPtr->result = result;
+        flightPtr->nrows = nrows;
+        if (result != TCL_OK) {
+            Ns_DStringAppend(&flightPtr->error, Tcl_GetStringResult(interp));
+        } else if (nrows > 0) {
+            flightPtr->rowPtr = Ns_SetCopy(rowPtr);
+        }
+        if (flightPtr->waiters == 0) {
+            ODBCFreeFlight(flightPtr);
+        } else {
+            Ns_CondBroadcast(&flightPtr->cond);
+        }
+        Ns_MutexUnlock(&flights.lock);
+    }
+
+ done:
+    Ns_DStringFree(&key);
+    if (rowPtr != NULL) {
+        if (nrows == 0) {
+            Ns_SetFree(rowPtr);
+        } else {
+            Ns_TclEnterSet(interp, rowPtr, 1);
+        }
+    }
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCRunRow --
+ *
+ *      Run the query of "ns_odbc_bind 1row|0or1row".
+ *
+ * Results:
+ *      Standard Tcl result. The row is left in *rowPtrPtr, and the
+ *      number of rows (0 or 1) in *nrowsPtr.
+ *
+ * Side effects:
+ *      Sets the error message in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCRunRow(Tcl_Interp *interp, Ns_DbHandle *handle, const char *cmd, const char *query,
+           const Ns_Set *set, Ns_Set **rowPtrPtr, int *nrowsPtr)
+{
+    char *sql;
+
+    sql = ODBCBindQuery(interp, handle, query, set);
+    if (sql == NULL) {
+        return TCL_ERROR;
+    }
+    *nrowsPtr = 1;
+    *rowPtrPtr = STREQ(cmd, "1row") ? Ns_Db1Row(handle, sql)
+        : Ns_Db0or1Row(handle, sql, nrowsPtr);
+    if (*rowPtrPtr == NULL) {
+        return DbFail(interp, handle, cmd, sql);
+    }
+    ns_free(sql);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCPoolGetHandle --
+ *
+ *      Get a handle from a pool for a command given a pool name,
+ *      waiting at most the "gethandletimeout" of the pool. The pool
+ *      must be of this driver.
+ *
+ * Results:
+ *      Handle, or NULL with the error message in interp.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Ns_DbHandle *
+ODBCPoolGetHandle(Tcl_Interp *interp, const char *pool)
+{
+    Ns_DbHandle *handle;
+    Ns_Time      wait;
+
+    ODBCHandleTimeout(pool, &wait);
+    handle = Ns_DbPoolTimedGetHandle(pool, &wait);
+    if (handle == NULL) {
+        Tcl_AppendResult(interp, "could not get handle from pool \"", pool, "\"", NULL);
+    } else if (Ns_DbDriverName(handle) != odbcName) {
+        Ns_DbPoolPutHandle(handle);
+        handle = NULL;
+        Tcl_AppendResult(interp, "pool \"", pool, "\" is not of type \"",
+                         odbcName, "\"", NULL);
+    }
+
+    return handle;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCHandleTimeout --
+ *
+ *      Get the pool parameter "gethandletimeout": how long commands
+ *      getting their own handles wait for a free one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets *timePtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCHandleTimeout(const char *pool, Ns_Time *timePtr)
+{
+    const char *path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", pool, NULL);
+
+    (void) Ns_ConfigTimeUnitRange(path, "gethandletimeout", "30s", 0, 0,
+                                  INT_MAX, 0, timePtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCRoutesInit --
+ *
+ *      Set up the routes listed in the driver parameter "routes". Each
+ *      route is configured in the section "$configPath/route/$name"
+ *      with the parameters "writepool", "readpools" (list of pool
+ *      names, each optionally followed by an integer weight) and
+ *      "stickytime".
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Invalid routes are logged and ignored.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCRoutesInit(const char *configPath)
+{
+    const char  *routes, *readPools, **namev, **poolv;
+    Ns_DString   ds;
+    int          namec, poolc, i, j, isNew;
+
+    Tcl_InitHashTable(&routesTable, TCL_STRING_KEYS);
+    Ns_TlsAlloc(&stickyTls, ns_free);
+    routes = Ns_ConfigGetValue(configPath, "routes");
+    if (routes == NULL || Tcl_SplitList(NULL, routes, &namec, &namev) != TCL_OK) {
+        return;
+    }
+    Ns_DStringInit(&ds);
+    for (i = 0; i < namec; i++) {
+        OdbcRoute     *routePtr;
+        Tcl_HashEntry *hPtr;
+        const char    *writePool;
+
+        if (Tcl_FindHashEntry(&routesTable, namev[i]) != NULL) {
+            Ns_Log(Error, "nsodbc: duplicate route \"%s\"", namev[i]);
+            continue;
+        }
+        Ns_DStringSetLength(&ds, 0);
+        Ns_DStringVarAppend(&ds, configPath, "/route/", namev[i], NULL);
+        writePool = Ns_ConfigGetValue(ds.string, "writepool");
+        if (writePool == NULL) {
+            Ns_Log(Error, "nsodbc: route \"%s\": no writepool", namev[i]);
+            continue;
+        }
+        readPools = Ns_ConfigGetValue(ds.string, "readpools");
+        if (readPools == NULL) {
+            readPools = "";
+        }
+        if (Tcl_SplitList(NULL, readPools, &poolc, &poolv) != TCL_OK) {
+            Ns_Log(Error, "nsodbc: route \"%s\": invalid readpools", namev[i]);
+            continue;
+        }
+        routePtr = ns_calloc(1u, sizeof(OdbcRoute));
+        routePtr->writePool = ns_strdup(writePool);
+        routePtr->readPools = ns_calloc((size_t)poolc + 1u, sizeof(char *));
+        routePtr->weights = ns_calloc((size_t)poolc + 1u, sizeof(int));
+        for (j = 0; j < poolc; j++) {
+            int weight = 1;
+
+            if (j + 1 < poolc && Tcl_GetInt(NULL, poolv[j + 1], &weight) == TCL_OK) {
+                if (weight < 0) {
+                    weight = 0;
+                }
+                routePtr->readPools[routePtr->numReadPools] = ns_strdup(poolv[j]);
+                routePtr->weights[routePtr->numReadPools++] = weight;
+                routePtr->totalWeight += weight;
+                j++;
+            } else {
+                routePtr->readPools[routePtr->numReadPools] = ns_strdup(poolv[j]);
+                routePtr->weights[routePtr->numReadPools++] = 1;
+                routePtr->totalWeight++;
+            }
+        }
+        Tcl_Free((char *)poolv);
+        if (routePtr->totalWeight == 0) {
+            routePtr->numReadPools = 0;
+        }
+        (void) Ns_ConfigTimeUnitRange(ds.string, "stickytime", "5s", 0, 0,
+                                      INT_MAX, 0, &routePtr->stickyTime);
+        hPtr = Tcl_CreateHashEntry(&routesTable, namev[i], &isNew);
+        routePtr->name = Tcl_GetHashKey(&routesTable, hPtr);
+        routePtr->index = numRoutes++;
+        Tcl_SetHashValue(hPtr, routePtr);
+        Ns_Log(Notice, "nsodbc: route \"%s\": write pool %s, %d read pools",
+               routePtr->name, routePtr->writePool, routePtr->numReadPools);
+    }
+    Ns_DStringFree(&ds);
+    Tcl_Free((char *)namev);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCGetRoute --
+ *
+ *      Find a route by name.
+ *
+ * Results:
+ *      Route, or NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static OdbcRoute *
+ODBCGetRoute(const char *name)
+{
+    const Tcl_HashEntry *hPtr;
+
+    if (numRoutes == 0) {
+        return NULL;
+    }
+    hPtr = Tcl_FindHashEntry(&routesTable, name);
+    return (hPtr != NULL) ? Tcl_GetHashValue(hPtr) : NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCRoutePool --
+ *
+ *      Select the pool of a route for a read or a write. Writes go to
+ *      the write pool and open a sticky window of "stickytime", during
+ *      which reads of the same request go to the write pool as well,
+ *      so that they see the changes. Otherwise, a read pool is picked
+ *      randomly according to the weights.
+ *
+ * Results:
+ *      Pool name. *stickyPtr is set when a read went to the write pool
+ *      because of the sticky window.
+ *
+ * Side effects:
+ *      Updates the sticky window of the thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+ODBCRoutePool(const OdbcRoute *routePtr, bool write, bool *stickyPtr)
+{
+    OdbcSticky    *windowPtr;
+    uintptr_t      connId;
+    Ns_Time        now;
+    double         r;
+    int            i;
+
+    *stickyPtr = NS_FALSE;
+    windowPtr = ODBCStickyWindow(routePtr, &connId);
+    Ns_GetTime(&now);
+
+    if (write) {
+        windowPtr->connId = connId;
+        windowPtr->until = now;
+        Ns_IncrTime(&windowPtr->until, routePtr->stickyTime.sec,
+                    routePtr->stickyTime.usec);
+        return routePtr->writePool;
+    }
+    if (routePtr->numReadPools == 0) {
+        return routePtr->writePool;
+    }
+    if (windowPtr->connId == connId && Ns_DiffTime(&windowPtr->until, &now, NULL) > 0) {
+        *stickyPtr = NS_TRUE;
+        return routePtr->writePool;
+    }
+
+    r = Ns_DRand() * (double)routePtr->totalWeight;
+    for (i = 0; i < routePtr->numReadPools - 1; i++) {
+        r -= (double)routePtr->weights[i];
+        if (r < 0.0) {
+            break;
+        }
+    }
+    return routePtr->readPools[i];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCStickyWindow --
+ *
+ *      Get the sticky window of a route for the current thread.
+ *
+ * Results:
+ *      Pointer to the window. *connIdPtr is set to the id of the
+ *      current connection, or 0 outside of requests.
+ *
+ * Side effects:
+ *      Allocates the windows of the thread on first use.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static OdbcSticky *
+ODBCStickyWindow(const OdbcRoute *routePtr, uintptr_t *connIdPtr)
+{
+    OdbcSticky    *stickyv;
+    const Ns_Conn *conn = Ns_GetConn();
+
+    *connIdPtr = (conn != NULL) ? Ns_ConnId(conn) : 0u;
+    stickyv = Ns_TlsGet(&stickyTls);
+    if (stickyv == NULL) {
+        stickyv = ns_calloc((size_t)numRoutes, sizeof(OdbcSticky));
+        Ns_TlsSet(&stickyTls, stickyv);
+    }
+    return &stickyv[routePtr->index];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCMarkWrite --
+ *
+ *      Open the sticky window of all routes writing to the pool, after
+ *      a write on a handle of the pool, e.g. one taken from the pool
+ *      returned by "ns_odbc route name write".
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the sticky windows of the thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCMarkWrite(const char *pool)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    bool            sticky;
+
+    for (hPtr = Tcl_FirstHashEntry(&routesTable, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        const OdbcRoute *routePtr = Tcl_GetHashValue(hPtr);
+
+        if (STREQ(routePtr->writePool, pool)) {
+            (void) ODBCRoutePool(routePtr, NS_TRUE, &sticky);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCRoutedCmd --
+ *
+ *      Implements "ns_odbc_bind dml|1row|0or1row route ?-bind setId?
+ *      sql": take a handle from the pool selected by the route (write
+ *      pool for "dml", read pool otherwise), run the statement and
+ *      return the handle.
+ *
+ * Results:
+ *      Standard Tcl result, as with a handle.
+ *
+ * Side effects:
+ *      Writes open the sticky window of the route.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCRoutedCmd(Tcl_Interp *interp, int argc, const char *argv[], const OdbcRoute *routePtr)
+{
+    Ns_DbHandle    *handle;
+    const Ns_Set   *set = NULL;
+    Ns_Set         *rowPtr;
+    const char     *pool, *server, *cmd = argv[1];
+    char           *sql;
+    bool            sticky;
+    int             result, nrows;
+
+    if ((argc != 4 && argc != 6) || (argc == 6 && !STREQ(argv[3], "-bind"))) {
+        return BadArgs(interp, argv, "route ?-bind setId? sql");
+    }
+    if (!STREQ(cmd, "dml") && !STREQ(cmd, "1row") && !STREQ(cmd, "0or1row")) {
+        Tcl_AppendResult(interp, "\"", cmd, "\" needs a handle, get one from the pool "
+                         "returned by \"ns_odbc route ", argv[2], " read|write\"", NULL);
+        return TCL_ERROR;
+    }
+    if (argc == 6) {
+        set = Ns_TclGetSet(interp, argv[4]);
+        if (set == NULL) {
+            Tcl_AppendResult(interp, "invalid set id `", argv[4], "'", NULL);
+            return TCL_ERROR;
+        }
+    }
+    pool = ODBCRoutePool(routePtr, STREQ(cmd, "dml"), &sticky);
+    server = Ns_TclInterpServer(interp);
+    if (server == NULL || !Ns_DbPoolAllowable(server, pool)) {
+        Tcl_AppendResult(interp, "no access to pool: \"", pool, "\"", NULL);
+        return TCL_ERROR;
+    }
+    handle = ODBCPoolGetHandle(interp, pool);
+    if (handle == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (STREQ(cmd, "dml")) {
+        sql = ODBCBindQuery(interp, handle, argv[argc - 1], set);
+        if (sql == NULL) {
+            result = TCL_ERROR;
+        } else if (Ns_DbDML(handle, sql) != NS_OK) {
+            result = DbFail(interp, handle, cmd, sql);
+        } else {
+            ns_free(sql);
+            result = TCL_OK;
+        }
+    } else {
+        result = ODBCRunRow(interp, handle, cmd, argv[argc - 1], set, &rowPtr, &nrows);
+        if (result == TCL_OK) {
+            if (nrows == 0) {
+                Ns_SetFree(rowPtr);
+            } else {
+                Ns_TclEnterSet(interp, rowPtr, 1);
+            }
+        }
+    }
+    Ns_DbPoolPutHandle(handle);
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCRouteCmd --
+ *
+ *      Implements "ns_odbc route name read|write". Returns the pool
+ *      selected by the route, for statements needing a handle, e.g.
+ *      "ns_db select". "write" opens the sticky window of the route.
+ *
+ * Results:
+ *      Standard Tcl result; the pool name.
+ *
+ * Side effects:
+ *      See ODBCRoutePool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCRouteCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    const OdbcRoute *routePtr;
+    bool             sticky;
+
+    if (argc != 4 || (!STREQ(argv[3], "read") && !STREQ(argv[3], "write"))) {
+        return BadArgs(interp, argv, "name read|write");
+    }
+    routePtr = ODBCGetRoute(argv[2]);
+    if (routePtr == NULL) {
+        Tcl_AppendResult(interp, "no such route: \"", argv[2], "\"", NULL);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(ODBCRoutePool(routePtr, STREQ(argv[3], "write"),
+                                                            &sticky), -1));
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCFreeFlight --
+ *
+ *      Free a completed query of "-coalesce", after the last caller
+ *      waiting for it took its result.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCFreeFlight(OdbcFlight *flightPtr)
+{
+    if (flightPtr->rowPtr != NULL) {
+        Ns_SetFree(flightPtr->rowPtr);
+    }
+    Ns_DStringFree(&flightPtr->error);
+    Ns_CondDestroy(&flightPtr->cond);
+    ns_free(flightPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCFreeCachedRow --
+ *
+ *      Free a row of the result cache.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCFreeCachedRow(void *arg)
+{
+    Ns_SetFree(arg);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCCacheCmd --
+ *
+ *      Implements "ns_odbc cache flush ?-pool name? ?prefix?". Flushes
+ *      the entries of the result cache of all pools or of one pool
+ *      whose SQL starts with the prefix.
+ *
+ * Results:
+ *      Standard Tcl result; the number of flushed entries.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCCacheCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    const char     *pool = NULL, *prefix = "";
+    Ns_Entry       *entry;
+    Ns_CacheSearch  search;
+    size_t          prefixLength, poolLength = 0u;
+    int             argi, flushed = 0;
+
+    if (argc < 3 || !STREQ(argv[2], "flush")) {
+        return BadArgs(interp, argv, "flush ?-pool name? ?prefix?");
+    }
+    argi = 3;
+    if (argi + 1 < argc && STREQ(argv[argi], "-pool")) {
+        pool = argv[argi + 1];
+        poolLength = strlen(pool);
+        argi += 2;
+    }
+    if (argi + 1 == argc) {
+        prefix = argv[argi++];
+    }
+    if (argi != argc) {
+        return BadArgs(interp, argv, "flush ?-pool name? ?prefix?");
+    }
+    prefixLength = strlen(prefix);
+
+    Ns_CacheLock(resultCache);
+    for (entry = Ns_CacheFirstEntry(resultCache, &search); entry != NULL;
+         entry = Ns_CacheNextEntry(&search)) {
+        const char *key = Ns_CacheKey(entry);
+        const char *sql = strchr(key, ' ');
+
+        if (sql == NULL
+            || (pool != NULL && ((size_t)(sql - key) != poolLength
+                                 || strncmp(key, pool, poolLength) != 0))
+            || strncmp(sql + 1, prefix, prefixLength) != 0) {
+            continue;
+        }
+        Ns_CacheFlushEntry(entry);
+        flushed++;
+    }
+    Ns_CacheUnlock(resultCache);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(flushed));
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCBatchDMLCmd --
+ *
+ *      Implements "ns_odbc_bind batchdml dbId ?-sets? ?-chunksize n? sql
+ *      rows". The statement is prepared once, and the rows are sent as
+ *      parameter arrays of up to "chunksize" rows per SQLExecute. Every
+ *      row is either a list of values in the order of the bind variables
+ *      of the statement or, with "-sets", an ns_set id providing the
+ *      values by name.
+ *
+ * Results:
+ *      Standard Tcl result. The result is a dict with the number of
+ *      rows processed successfully ("rows") and the indices of the
+ *      failed rows ("errors").
+ *
+ * Side effects:
+ *      Database is modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCBatchDMLCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    OdbcConn       *connPtr;
+    OdbcTemplate   *tmplPtr;
+    Ns_DString      ds;
+    const char    **rowv = NULL, **values = NULL, ***splitv = NULL;
+    SQLUSMALLINT   *status = NULL;
+    Tcl_Obj        *errorsObj, *resultObj;
+    bool            useSets = NS_FALSE;
+    int             i, j, k, n, rowc, chunkSize = 0, argi, result = TCL_OK;
+    Tcl_WideInt     succeeded = 0;
+    char           *sql;
+
+    for (argi = 3; argi < argc - 2; argi++) {
+        if (STREQ(argv[argi], "-sets")) {
+            useSets = NS_TRUE;
+        } else if (STREQ(argv[argi], "-chunksize") && argi < argc - 3) {
+            if (Tcl_GetInt(interp, argv[++argi], &chunkSize) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (chunkSize < 1) {
+                Tcl_AppendResult(interp, "invalid chunksize \"", argv[argi], "\"", NULL);
+                return TCL_ERROR;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argc < 5 || argi != argc - 2) {
+        return BadArgs(interp, argv, "dbId ?-sets? ?-chunksize n? sql rows");
+    }
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    connPtr = handle->connection;
+    if (chunkSize == 0) {
+        chunkSize = connPtr->poolPtr->batchSize;
+    }
+    if (Tcl_SplitList(interp, argv[argc - 1], &rowc, &rowv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    /*
+     * Replace all bind variables by placeholders and prepare the
+     * statement.
+     */
+    tmplPtr = ODBCGetTemplate(argv[argc - 2]);
+    Ns_DStringInit(&ds);
+    for (i = 0; i <= tmplPtr->numVars; i++) {
+        Ns_DStringNAppend(&ds, tmplPtr->text + tmplPtr->fragments[i].offset,
+                          (int)tmplPtr->fragments[i].length);
+        if (i < tmplPtr->numVars) {
+            Ns_DStringNAppend(&ds, "?", 1);
+        }
+    }
+    sql = Ns_DStringExport(&ds);
+    Ns_DStringFree(&ds);
+
+    if (handle->statement != NULL) {
+        (void) ODBCFreeStmt(handle);
+    }
+    if (!RC_OK(ODBCPrepareStmt(handle, sql))) {
+        if (handle->statement != NULL) {
+            (void) ODBCFreeStmt(handle);
+        }
+        ODBCReleaseTemplate(tmplPtr);
+        ckfree((char *)rowv);
+        return DbFail(interp, handle, argv[1], sql);
+    }
+
+    n = (rowc < chunkSize) ? rowc : chunkSize;
+    values = ns_malloc((size_t)n * (size_t)tmplPtr->numVars * sizeof(char *) + 1u);
+    splitv = ns_calloc((size_t)n + 1u, sizeof(char **));
+    status = ns_malloc((size_t)n * sizeof(SQLUSMALLINT) + 1u);
+    errorsObj = Tcl_NewListObj(0, NULL);
+
+    for (i = 0; i < rowc && result == TCL_OK; i += n) {
+        n = (rowc - i < chunkSize) ? rowc - i : chunkSize;
+
+        /*
+         * Collect the values of the chunk, row by row.
+         */
+        for (k = 0; k < n && result == TCL_OK; k++) {
+            const char **valuev = &values[k * tmplPtr->numVars];
+
+            if (useSets) {
+                const Ns_Set *set = Ns_TclGetSet(interp, rowv[i + k]);
+
+                if (set == NULL) {
+                    Tcl_AppendResult(interp, "invalid set id `", rowv[i + k], "'", NULL);
+                    result = TCL_ERROR;
+                    break;
+                }
+                for (j = 0; j < tmplPtr->numVars; j++) {
+                    valuev[j] = Ns_SetGet(set, tmplPtr->varNames[j]);
+                    if (valuev[j] == NULL) {
+                        Tcl_AppendResult(interp, "undefined variable `",
+                                         tmplPtr->varNames[j], "' in set `",
+                                         rowv[i + k], "'", NULL);
+                        result = TCL_ERROR;
+                        break;
+                    }
+                }
+            } else {
+                int valuec;
+
+                if (Tcl_SplitList(interp, rowv[i + k], &valuec, &splitv[k]) != TCL_OK) {
+                    result = TCL_ERROR;
+                    break;
+                }
+                if (valuec != tmplPtr->numVars) {
+                    Tcl_AppendResult(interp, "row ", rowv[i + k],
+                                     " does not match the bind variables of the statement",
+                                     NULL);
+                    result = TCL_ERROR;
+                    break;
+                }
+                memcpy(valuev, splitv[k], (size_t)valuec * sizeof(char *));
+            }
+        }
+
+        if (result == TCL_OK) {
+            (void) ODBCExecChunk(handle, tmplPtr->numVars, n, values, NULL, '\0', status);
+            for (k = 0; k < n; k++) {
+                if (status[k] == SQL_PARAM_SUCCESS
+                    || status[k] == SQL_PARAM_SUCCESS_WITH_INFO) {
+                    succeeded++;
+                } else {
+                    Tcl_ListObjAppendElement(NULL, errorsObj, Tcl_NewIntObj(i + k));
+                }
+            }
+        }
+        for (k = 0; k < n; k++) {
+            if (splitv[k] != NULL) {
+                ckfree((char *)splitv[k]);
+                splitv[k] = NULL;
+            }
+        }
+    }
+
+    (void) ODBCFreeStmt(handle);
+    ODBCReleaseTemplate(tmplPtr);
+    ckfree((char *)rowv);
+    ns_free(values);
+    ns_free(splitv);
+    ns_free(status);
+
+    if (result != TCL_OK) {
+        Tcl_DecrRefCount(errorsObj);
+        ns_free(sql);
+        return TCL_ERROR;
+    }
+    if (succeeded == 0 && rowc > 0) {
+        Tcl_DecrRefCount(errorsObj);
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    ns_free(sql);
+    resultObj = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("rows", 4), Tcl_NewWideIntObj(succeeded));
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("errors", 6), errorsObj);
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCQueryCmd --
+ *
+ *      Implements "ns_odbc query dbId sql ?-dicts? ?-null value? ?-bind
+ *      setId?". Bind variables are handled as with ns_odbc_bind. The
+ *      values are fetched in their native C types and returned as
+ *      Tcl_Objs with the matching internal representation (see
+ *      ODBCGetObj).
+ *
+ * Results:
+ *      Standard Tcl result. The result is a list of rows, each a list
+ *      of values or, with "-dicts", a dict keyed by column name. NULL
+ *      values are returned as the "-null" value (default: empty
+ *      string) in lists and are omitted from dicts.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCQueryCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    const Ns_Set   *set = NULL;
+    Tcl_Obj        *nullObj, *resultObj;
+    bool            dicts = NS_FALSE;
+    const char     *nullValue = "";
+    char           *sql;
+    SQLRETURN       rc;
+    int             argi;
+
+    for (argi = 4; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-dicts")) {
+            dicts = NS_TRUE;
+        } else if (STREQ(argv[argi], "-null") && argi + 1 < argc) {
+            nullValue = argv[++argi];
+        } else if (STREQ(argv[argi], "-bind") && argi + 1 < argc) {
+            set = Ns_TclGetSet(interp, argv[++argi]);
+            if (set == NULL) {
+                Tcl_AppendResult(interp, "invalid set id `", argv[argi], "'", NULL);
+                return TCL_ERROR;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argc < 4 || argi != argc) {
+        return BadArgs(interp, argv, "dbId sql ?-dicts? ?-null value? ?-bind setId?");
+    }
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    sql = ODBCBindQuery(interp, handle, argv[3], set);
+    if (sql == NULL) {
+        return TCL_ERROR;
+    }
+
+    switch (Ns_DbExec(handle, sql)) {
+    case NS_DML:
+        ns_free(sql);
+        Tcl_ResetResult(interp);
+        return TCL_OK;
+    case NS_ROWS:
+        break;
+    default:
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    nullObj = Tcl_NewStringObj(nullValue, -1);
+    Tcl_IncrRefCount(nullObj);
+    resultObj = Tcl_NewListObj(0, NULL);
+    rc = ODBCFetchRowsObj(handle, dicts, nullObj, resultObj);
+    Tcl_DecrRefCount(nullObj);
+    (void) ODBCFreeStmt(handle);
+
+    if (rc != SQL_NO_DATA) {
+        Tcl_DecrRefCount(resultObj);
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    ns_free(sql);
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCFetchRowsObj --
+ *
+ *      Describe the current result set of the handle and fetch all of
+ *      its rows as Tcl_Objs (see ODBCGetObj), for "ns_odbc query" and
+ *      "ns_odbc results".
+ *
+ * Results:
+ *      SQL_NO_DATA when all rows were fetched, otherwise the ODBC
+ *      return code of the failed call. The rows are appended to
+ *      listObj, each a list of values or, when "dicts" is set, a dict
+ *      keyed by column name. NULL values are returned as nullObj in
+ *      lists and are omitted from dicts.
+ *
+ * Side effects:
+ *      The statement is not freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCFetchRowsObj(Ns_DbHandle *handle, bool dicts, Tcl_Obj *nullObj, Tcl_Obj *listObj)
+{
+    OdbcConn       *connPtr = handle->connection;
+    Tcl_Obj       **nameObjs, **valueObjs;
+    SQLRETURN       rc = SQL_SUCCESS;
+    SQLSMALLINT     i;
+    Ns_Time         start;
+
+    Ns_GetTime(&start);
+    if (!ODBCDescribeColumns(handle) || !ODBCBindColumns(handle, NS_FALSE)) {
+        return SQL_ERROR;
+    }
+    ODBCPhaseDone(connPtr, ODBC_PHASE_DESCRIBE, &start);
+
+    nameObjs = ns_malloc(2u * (size_t)connPtr->numCols * sizeof(Tcl_Obj *) + 1u);
+    valueObjs = nameObjs + connPtr->numCols;
+    for (i = 0; i < connPtr->numCols; i++) {
+        nameObjs[i] = Tcl_NewStringObj(connPtr->columns[i].name, -1);
+        Tcl_IncrRefCount(nameObjs[i]);
+    }
+
+    while (RC_OK(rc)) {
+        Tcl_Obj *rowObj = NULL;
+
+        rc = ODBCSQLFetch(handle);
+        if (rc == SQL_NO_DATA) {
+            break;
+        }
+        ODBCLog(rc, handle);
+        if (dicts) {
+            rowObj = Tcl_NewDictObj();
+        }
+        for (i = 0; RC_OK(rc) && i < connPtr->numCols; i++) {
+            Tcl_Obj *valueObj;
+
+            Ns_GetTime(&start);
+            rc = ODBCGetObj(handle, (SQLUSMALLINT)i, &valueObj);
+            ODBCPhaseDone(connPtr, ODBC_PHASE_GETDATA, &start);
+            if (!RC_OK(rc)) {
+                break;
+            } else if (dicts) {
+                if (valueObj != NULL) {
+                    Tcl_DictObjPut(NULL, rowObj, nameObjs[i], valueObj);
+                }
+            } else {
+                valueObjs[i] = (valueObj != NULL) ? valueObj : nullObj;
+            }
+        }
+        if (!RC_OK(rc)) {
+            if (rowObj != NULL) {
+                Tcl_DecrRefCount(rowObj);
+            }
+            break;
+        }
+        if (!dicts) {
+            rowObj = Tcl_NewListObj(connPtr->numCols, valueObjs);
+        }
+        Tcl_ListObjAppendElement(NULL, listObj, rowObj);
+    }
+
+    for (i = 0; i < connPtr->numCols; i++) {
+        Tcl_DecrRefCount(nameObjs[i]);
+    }
+    ns_free(nameObjs);
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCResultsCmd --
+ *
+ *      Implements "ns_odbc results dbId sql ?-dicts? ?-null value?
+ *      ?-bind setId?". Executes a batch of statements or a procedure
+ *      and collects all of its results with SQLMoreResults, in one
+ *      round trip.
+ *
+ * Results:
+ *      Standard Tcl result. The result is a list with a dict per
+ *      result: for result sets with the keys "columns" (list of
+ *      column names) and "rows" (rows as with "ns_odbc query"), for
+ *      DML statements with the key "rowcount" (affected rows, -1 when
+ *      not known).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCResultsCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    OdbcConn       *connPtr;
+    const Ns_Set   *set = NULL;
+    Tcl_Obj        *nullObj, *resultObj;
+    bool            dicts = NS_FALSE;
+    const char     *nullValue = "";
+    char           *sql;
+    SQLRETURN       rc;
+    SQLSMALLINT     numCols, i;
+    SQLLEN          rowCount;
+    int             argi;
+
+    for (argi = 4; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-dicts")) {
+            dicts = NS_TRUE;
+        } else if (STREQ(argv[argi], "-null") && argi + 1 < argc) {
+            nullValue = argv[++argi];
+        } else if (STREQ(argv[argi], "-bind") && argi + 1 < argc) {
+            set = Ns_TclGetSet(interp, argv[++argi]);
+            if (set == NULL) {
+                Tcl_AppendResult(interp, "invalid set id `", argv[argi], "'", NULL);
+                return TCL_ERROR;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argc < 4 || argi != argc) {
+        return BadArgs(interp, argv, "dbId sql ?-dicts? ?-null value? ?-bind setId?");
+    }
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    sql = ODBCBindQuery(interp, handle, argv[3], set);
+    if (sql == NULL) {
+        return TCL_ERROR;
+    }
+    rc = ODBCExecute(handle, sql);
+    if (handle->statement == NULL) {
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    if (rc == SQL_NO_DATA) {
+        /*
+         * Searched UPDATE or DELETE affecting no rows.
+         */
+        rc = SQL_SUCCESS;
+    }
+    connPtr = handle->connection;
+    nullObj = Tcl_NewStringObj(nullValue, -1);
+    Tcl_IncrRefCount(nullObj);
+    resultObj = Tcl_NewListObj(0, NULL);
+
+    while (RC_OK(rc)) {
+        Tcl_Obj *setObj = Tcl_NewDictObj();
+
+        rc = SQLNumResultCols((SQLHSTMT) handle->statement, &numCols);
+        ODBCLog(rc, handle);
+        if (!RC_OK(rc)) {
+            Tcl_DecrRefCount(setObj);
+            break;
+        }
+        if (numCols > 0) {
+            Tcl_Obj *rowsObj = Tcl_NewListObj(0, NULL), *columnsObj;
+
+            rc = ODBCFetchRowsObj(handle, dicts, nullObj, rowsObj);
+            if (rc != SQL_NO_DATA) {
+                Tcl_DecrRefCount(rowsObj);
+                Tcl_DecrRefCount(setObj);
+                break;
+            }
+            columnsObj = Tcl_NewListObj(0, NULL);
+            for (i = 0; i < connPtr->numCols; i++) {
+                Tcl_ListObjAppendElement(NULL, columnsObj,
+                                         Tcl_NewStringObj(connPtr->columns[i].name, -1));
+            }
+            Tcl_DictObjPut(NULL, setObj, Tcl_NewStringObj("columns", 7), columnsObj);
+            Tcl_DictObjPut(NULL, setObj, Tcl_NewStringObj("rows", 4), rowsObj);
+            ODBCResetColumns(connPtr);
+        } else {
+            rc = SQLRowCount((SQLHSTMT) handle->statement, &rowCount);
+            ODBCLog(rc, handle);
+            if (!RC_OK(rc)) {
+                Tcl_DecrRefCount(setObj);
+                break;
+            }
+            Tcl_DictObjPut(NULL, setObj, Tcl_NewStringObj("rowcount", 8),
+                           Tcl_NewWideIntObj((Tcl_WideInt)rowCount));
+        }
+        Tcl_ListObjAppendElement(NULL, resultObj, setObj);
+
+        ODBCWatchCall(connPtr);
+        rc = SQLMoreResults((SQLHSTMT) handle->statement);
+        ODBCUnwatchStmt(connPtr);
+        if (rc == SQL_NO_DATA) {
+            break;
+        }
+        ODBCLog(rc, handle);
+    }
+    Tcl_DecrRefCount(nullObj);
+    (void) ODBCFreeStmt(handle);
+
+    if (rc != SQL_NO_DATA) {
+        Tcl_DecrRefCount(resultObj);
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    ns_free(sql);
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCForeachCmd --
+ *
+ *      Implements "ns_odbc foreach rowVar dbId sql ?-bind setId?
+ *      body". The rows of the query are fetched one at a time (or in
+ *      rowsets, see "rowsetsize") and stored directly in the array
+ *      rowVar, keyed by column name, before the body is evaluated.
+ *      No Ns_Set or list is built per row, so the memory use does not
+ *      depend on the size of the result.
+ *
+ * Results:
+ *      Standard Tcl result. "break" and "continue" work as in the
+ *      Tcl looping commands.
+ *
+ * Side effects:
+ *      Depends on the body.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCForeachCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    OdbcConn       *connPtr;
+    const Ns_Set   *set = NULL;
+    Tcl_Obj        *varObj, *bodyObj, **nameObjs, *nullObj;
+    void           *hstmt;
+    char           *sql;
+    SQLUSMALLINT    i;
+    Ns_ReturnCode   status;
+    int             result = TCL_OK;
+
+    if (argc == 8 && STREQ(argv[5], "-bind")) {
+        set = Ns_TclGetSet(interp, argv[6]);
+        if (set == NULL) {
+            Tcl_AppendResult(interp, "invalid set id `", argv[6], "'", NULL);
+            return TCL_ERROR;
+        }
+    } else if (argc != 6) {
+        return BadArgs(interp, argv, "rowVar dbId sql ?-bind setId? body");
+    }
+    if (ODBCGetHandle(interp, argv[3], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    sql = ODBCBindQuery(interp, handle, argv[4], set);
+    if (sql == NULL) {
+        return TCL_ERROR;
+    }
+    if (Ns_DbSelect(handle, sql) == NULL) {
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    connPtr = handle->connection;
+    hstmt = handle->statement;
+
+    varObj = Tcl_NewStringObj(argv[2], -1);
+    Tcl_IncrRefCount(varObj);
+    bodyObj = Tcl_NewStringObj(argv[argc - 1], -1);
+    Tcl_IncrRefCount(bodyObj);
+    nullObj = Tcl_NewObj();
+    Tcl_IncrRefCount(nullObj);
+    nameObjs = ns_malloc((size_t)connPtr->numCols * sizeof(Tcl_Obj *) + 1u);
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        nameObjs[i] = Tcl_NewStringObj(connPtr->columns[i].name, -1);
+        Tcl_IncrRefCount(nameObjs[i]);
+    }
+
+    while ((status = ODBCFetch(handle)) == NS_OK) {
+        for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+            const char *value;
+            SQLLEN      length;
+            Tcl_Obj    *valueObj;
+
+            if (!ODBCColumnValue(handle, i, &value, &length)) {
+                status = NS_ERROR;
+                break;
+            }
+            valueObj = (value == NULL) ? nullObj : Tcl_NewStringObj(value, (int)length);
+            if (Tcl_ObjSetVar2(interp, varObj, nameObjs[i], valueObj,
+                               TCL_LEAVE_ERR_MSG) == NULL) {
+                result = TCL_ERROR;
+                break;
+            }
+        }
+        if (status != NS_OK || result != TCL_OK) {
+            break;
+        }
+        result = Tcl_EvalObjEx(interp, bodyObj, 0);
+        if (handle->statement != hstmt) {
+            Tcl_ResetResult(interp);
+            Tcl_AppendResult(interp, "handle \"", argv[3],
+                             "\" was used for another statement in the loop body", NULL);
+            result = TCL_ERROR;
+            break;
+        } else if (result == TCL_CONTINUE) {
+            result = TCL_OK;
+        } else if (result != TCL_OK) {
+            if (result == TCL_ERROR) {
+                char msg[64];
+
+                snprintf(msg, sizeof(msg), "\n    (\"ns_odbc foreach\" body line %d)",
+                         Tcl_GetErrorLine(interp));
+                Tcl_AddErrorInfo(interp, msg);
+            }
+            break;
+        }
+    }
+
+    /*
+     * Discard pending rows when leaving the loop early.
+     */
+    if (handle->fetchingRows && handle->statement == hstmt) {
+        (void) Ns_DbFlush(handle);
+    }
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        Tcl_DecrRefCount(nameObjs[i]);
+    }
+    ns_free(nameObjs);
+    Tcl_DecrRefCount(nullObj);
+    Tcl_DecrRefCount(bodyObj);
+    Tcl_DecrRefCount(varObj);
+
+    if (status == NS_ERROR) {
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    ns_free(sql);
+    if (result == TCL_BREAK) {
+        result = TCL_OK;
+    }
+    if (result == TCL_OK) {
+        Tcl_ResetResult(interp);
+    }
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCJsonString --
+ *
+ *      Append a value as JSON string, with the characters escaped
+ *      which must not appear unescaped in JSON strings.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Appends to dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCJsonString(Ns_DString *dsPtr, const char *value, size_t length)
+{
+    const char *p, *end = value + length;
+
+    Ns_DStringNAppend(dsPtr, "\"", 1);
+    for (p = value; p < end; p++) {
+        unsigned char c = UCHAR(*p);
+
+        if (c >= 0x20u && c != UCHAR('"') && c != UCHAR('\\')) {
+            continue;
+        }
+        Ns_DStringNAppend(dsPtr, value, (int)(p - value));
+        value = p + 1;
+        switch (c) {
+        case '"':  Ns_DStringNAppend(dsPtr, "\\\"", 2); break;
+        case '\\': Ns_DStringNAppend(dsPtr, "\\\\", 2); break;
+        case '\n': Ns_DStringNAppend(dsPtr, "\\n", 2); break;
+        case '\r': Ns_DStringNAppend(dsPtr, "\\r", 2); break;
+        case '\t': Ns_DStringNAppend(dsPtr, "\\t", 2); break;
+        default:   Ns_DStringPrintf(dsPtr, "\\u%04x", c); break;
+        }
+    }
+    Ns_DStringNAppend(dsPtr, value, (int)(end - value));
+    Ns_DStringNAppend(dsPtr, "\"", 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCJsonNumber --
+ *
+ *      Append a numeric value as JSON number. Drivers may return
+ *      decimals without leading zero (".5") or special float values
+ *      ("NaN", "Inf") which are not valid JSON numbers; the former are
+ *      fixed, the latter are appended as strings.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Appends to dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCJsonNumber(Ns_DString *dsPtr, const char *value, size_t length)
+{
+    size_t sign = (*value == '-' || *value == '+') ? 1u : 0u;
+
+    if (sign == length || (value[sign] != '.' && CHARTYPE(digit, value[sign]) == 0)) {
+        ODBCJsonString(dsPtr, value, length);
+        return;
+    }
+    if (*value == '-') {
+        Ns_DStringNAppend(dsPtr, "-", 1);
+    }
+    if (value[sign] == '.') {
+        Ns_DStringNAppend(dsPtr, "0", 1);
+    }
+    Ns_DStringNAppend(dsPtr, value + sign, (int)(length - sign));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCJsonCmd --
+ *
+ *      Implements "ns_odbc json dbId sql ?-bind setId? ?-conn?". The
+ *      rows of the query are serialized as an array of objects keyed
+ *      by column name into a single buffer. The keys are escaped once
+ *      per result set. Numeric values are emitted as numbers, bit
+ *      values as booleans, NULL values as null and all other values as
+ *      strings.
+ *
+ * Results:
+ *      Standard Tcl result. The JSON text, or with "-conn" an empty
+ *      result after the text was sent as "application/json" response
+ *      to the current connection.
+ *
+ * Side effects:
+ *      With "-conn", the response of the connection is sent.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCJsonCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    const OdbcConn *connPtr;
+    const Ns_Set   *set = NULL;
+    Ns_Conn        *conn = NULL;
+    Ns_DString      ds, keys;
+    int            *keyOffsets;
+    char           *sql;
+    SQLUSMALLINT    i;
+    Ns_ReturnCode   status;
+    int             argi, nrows = 0;
+
+    for (argi = 4; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-conn")) {
+            conn = Ns_GetConn();
+            if (conn == NULL) {
+                Tcl_AppendResult(interp, "no current connection", NULL);
+                return TCL_ERROR;
+            }
+        } else if (STREQ(argv[argi], "-bind") && argi + 1 < argc) {
+            set = Ns_TclGetSet(interp, argv[++argi]);
+            if (set == NULL) {
+                Tcl_AppendResult(interp, "invalid set id `", argv[argi], "'", NULL);
+                return TCL_ERROR;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argc < 4 || argi != argc) {
+        return BadArgs(interp, argv, "dbId sql ?-bind setId? ?-conn?");
+    }
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    sql = ODBCBindQuery(interp, handle, argv[3], set);
+    if (sql == NULL) {
+        return TCL_ERROR;
+    }
+    if (Ns_DbSelect(handle, sql) == NULL) {
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    connPtr = handle->connection;
+
+    /*
+     * Escape the keys once: keys holds '"name":' for all columns,
+     * starting at keyOffsets[i].
+     */
+    Ns_DStringInit(&keys);
+    keyOffsets = ns_malloc(((size_t)connPtr->numCols + 1u) * sizeof(int));
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        const char *name = connPtr->columns[i].name;
+
+        keyOffsets[i] = Ns_DStringLength(&keys);
+        ODBCJsonString(&keys, name, strlen(name));
+        Ns_DStringNAppend(&keys, ":", 1);
+    }
+    keyOffsets[i] = Ns_DStringLength(&keys);
+
+    Ns_DStringInit(&ds);
+    Ns_DStringNAppend(&ds, "[", 1);
+    while ((status = ODBCFetch(handle)) == NS_OK) {
+        if (nrows++ > 0) {
+            Ns_DStringNAppend(&ds, ",", 1);
+        }
+        Ns_DStringNAppend(&ds, "{", 1);
+        for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+            const char *value;
+            SQLLEN      length;
+
+            if (!ODBCColumnValue(handle, i, &value, &length)) {
+                status = NS_ERROR;
+                break;
+            }
+            if (i > 0u) {
+                Ns_DStringNAppend(&ds, ",", 1);
+            }
+            Ns_DStringNAppend(&ds, keys.string + keyOffsets[i],
+                              keyOffsets[i + 1] - keyOffsets[i]);
+            if (value == NULL) {
+                Ns_DStringNAppend(&ds, "null", 4);
+                continue;
+            }
+            switch (connPtr->columns[i].sqlType) {
+            case SQL_BIT:
+                if (*value == '0') {
+                    Ns_DStringNAppend(&ds, "false", 5);
+                } else {
+                    Ns_DStringNAppend(&ds, "true", 4);
+                }
+                break;
+            case SQL_TINYINT:
+            case SQL_SMALLINT:
+            case SQL_INTEGER:
+            case SQL_BIGINT:
+            case SQL_NUMERIC:
+            case SQL_DECIMAL:
+            case SQL_REAL:
+            case SQL_FLOAT:
+            case SQL_DOUBLE:
+                ODBCJsonNumber(&ds, value, (size_t)length);
+                break;
+            default:
+                ODBCJsonString(&ds, value, (size_t)length);
+                break;
+            }
+        }
+        if (status != NS_OK) {
+            break;
+        }
+        Ns_DStringNAppend(&ds, "}", 1);
+    }
+    Ns_DStringNAppend(&ds, "]", 1);
+    ns_free(keyOffsets);
+    Ns_DStringFree(&keys);
+
+    if (status == NS_ERROR) {
+        if (handle->fetchingRows) {
+            (void) Ns_DbFlush(handle);
+        }
+        Ns_DStringFree(&ds);
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    ns_free(sql);
+
+    if (conn != NULL) {
+        status = Ns_ConnReturnCharData(conn, 200, ds.string, Ns_DStringLength(&ds),
+                                       "application/json");
+        Ns_DStringFree(&ds);
+        if (status != NS_OK) {
+            Tcl_AppendResult(interp, "could not send response", NULL);
+            return TCL_ERROR;
+        }
+        Tcl_ResetResult(interp);
+    } else {
+        Tcl_DStringResult(interp, &ds);
+    }
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCWriterFlush --
+ *
+ *      Write the buffered output of ns_odbc copyout to the channel or
+ *      the connection.
+ *
+ * Results:
+ *      NS_TRUE on success, NS_FALSE when writing failed.
+ *
+ * Side effects:
+ *      Empties the buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCWriterFlush(OdbcWriter *writerPtr)
+{
+    if (writerPtr->length > 0u && !writerPtr->failed) {
+        if (writerPtr->chan != NULL) {
+            writerPtr->failed = (Tcl_Write(writerPtr->chan, writerPtr->buf,
+                                           (int)writerPtr->length) < 0);
+        } else {
+            writerPtr->failed = (Ns_ConnWriteData(writerPtr->conn, writerPtr->buf,
+                                                  writerPtr->length, NS_CONN_STREAM) != NS_OK);
+        }
+    }
+    writerPtr->length = 0u;
+
+    return !writerPtr->failed;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCWriterPut --
+ *
+ *      Append bytes to the output buffer of ns_odbc copyout, flushing
+ *      it whenever it is full.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May write to the channel or connection.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCWriterPut(OdbcWriter *writerPtr, const char *bytes, size_t length)
+{
+    while (length > 0u) {
+        size_t n = sizeof(writerPtr->buf) - writerPtr->length;
+
+        if (n > length) {
+            n = length;
+        }
+        memcpy(writerPtr->buf + writerPtr->length, bytes, n);
+        writerPtr->length += n;
+        bytes += n;
+        length -= n;
+        if (writerPtr->length == sizeof(writerPtr->buf)) {
+            (void) ODBCWriterFlush(writerPtr);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCWriterField --
+ *
+ *      Append a field to the output of ns_odbc copyout. The field is
+ *      enclosed in quote characters, with embedded quotes doubled, if
+ *      it contains the delimiter, the quote character or a line break.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May write to the channel or connection.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCWriterField(OdbcWriter *writerPtr, const char *value, size_t length,
+                char delimiter, char quote)
+{
+    const char *p, *end = value + length;
+
+    if (quote == '\0') {
+        ODBCWriterPut(writerPtr, value, length);
+        return;
+    }
+    for (p = value; p < end; p++) {
+        if (*p == delimiter || *p == quote || *p == '\n' || *p == '\r') {
+            break;
+        }
+    }
+    if (p == end) {
+        ODBCWriterPut(writerPtr, value, length);
+        return;
+    }
+    ODBCWriterPut(writerPtr, &quote, 1u);
+    for (p = value; p < end; p++) {
+        if (*p == quote) {
+            ODBCWriterPut(writerPtr, value, (size_t)(p - value) + 1u);
+            value = p;
+        }
+    }
+    ODBCWriterPut(writerPtr, value, (size_t)(end - value));
+    ODBCWriterPut(writerPtr, &quote, 1u);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCCopyOutCmd --
+ *
+ *      Implements "ns_odbc copyout dbId sql ?-bind setId? ?-delimiter
+ *      c? ?-quote c? ?-header? -channel chan|-conn". The rows of the
+ *      query are formatted as delimited text (CSV by default, use
+ *      "-delimiter \t -quote {}" for TSV) into a fixed-size buffer
+ *      which is written to the channel or streamed to the current
+ *      connection whenever it is full. NULL values are written as
+ *      empty fields.
+ *
+ * Results:
+ *      Standard Tcl result; the number of rows written.
+ *
+ * Side effects:
+ *      Writes to the channel or connection.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCCopyOutCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    const OdbcConn *connPtr;
+    const Ns_Set   *set = NULL;
+    OdbcWriter     *writerPtr;
+    Tcl_Channel     chan = NULL;
+    Ns_Conn        *conn = NULL;
+    char           *sql, delimiter = ',', quote = '"';
+    bool            header = NS_FALSE;
+    SQLUSMALLINT    i;
+    Ns_ReturnCode   status = NS_OK;
+    Tcl_WideInt     nrows = 0;
+    int             argi, mode;
+
+    for (argi = 4; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-conn")) {
+            conn = Ns_GetConn();
+            if (conn == NULL) {
+                Tcl_AppendResult(interp, "no current connection", NULL);
+                return TCL_ERROR;
+            }
+        } else if (STREQ(argv[argi], "-header")) {
+            header = NS_TRUE;
+        } else if (argi + 1 == argc) {
+            break;
+        } else if (STREQ(argv[argi], "-channel")) {
+            chan = Tcl_GetChannel(interp, argv[++argi], &mode);
+            if (chan == NULL) {
+                return TCL_ERROR;
+            }
+            if ((mode & TCL_WRITABLE) == 0) {
+                Tcl_AppendResult(interp, "channel \"", argv[argi],
+                                 "\" wasn't opened for writing", NULL);
+                return TCL_ERROR;
+            }
+        } else if (STREQ(argv[argi], "-bind")) {
+            set = Ns_TclGetSet(interp, argv[++argi]);
+            if (set == NULL) {
+                Tcl_AppendResult(interp, "invalid set id `", argv[argi], "'", NULL);
+                return TCL_ERROR;
+            }
+        } else if (STREQ(argv[argi], "-delimiter") && strlen(argv[argi + 1]) == 1u) {
+            delimiter = *argv[++argi];
+        } else if (STREQ(argv[argi], "-quote") && strlen(argv[argi + 1]) <= 1u) {
+            quote = *argv[++argi];
+        } else {
+            break;
+        }
+    }
+    if (argc < 4 || argi != argc || (chan == NULL) == (conn == NULL)) {
+        return BadArgs(interp, argv, "dbId sql ?-bind setId? ?-delimiter c? ?-quote c? "
+                       "?-header? -channel chan|-conn");
+    }
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    sql = ODBCBindQuery(interp, handle, argv[3], set);
+    if (sql == NULL) {
+        return TCL_ERROR;
+    }
+    if (Ns_DbSelect(handle, sql) == NULL) {
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    connPtr = handle->connection;
+
+    writerPtr = ns_malloc(sizeof(OdbcWriter));
+    writerPtr->chan = chan;
+    writerPtr->conn = conn;
+    writerPtr->length = 0u;
+    writerPtr->failed = NS_FALSE;
+    if (conn != NULL) {
+        Ns_ConnSetTypeHeader(conn, (delimiter == '\t') ?
+                             "text/tab-separated-values" : "text/csv");
+    }
+
+    if (header) {
+        for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+            const char *name = connPtr->columns[i].name;
+
+            if (i > 0u) {
+                ODBCWriterPut(writerPtr, &delimiter, 1u);
+            }
+            ODBCWriterField(writerPtr, name, strlen(name), delimiter, quote);
+        }
+        ODBCWriterPut(writerPtr, "\n", 1u);
+    }
+    while (!writerPtr->failed && (status = ODBCFetch(handle)) == NS_OK) {
+        for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+            const char *value;
+            SQLLEN      length;
+
+            if (!ODBCColumnValue(handle, i, &value, &length)) {
+                status = NS_ERROR;
+                break;
+            }
+            if (i > 0u) {
+                ODBCWriterPut(writerPtr, &delimiter, 1u);
+            }
+            if (value != NULL) {
+                ODBCWriterField(writerPtr, value, (size_t)length, delimiter, quote);
+            }
+        }
+        if (status != NS_OK) {
+            break;
+        }
+        ODBCWriterPut(writerPtr, "\n", 1u);
+        nrows++;
+    }
+    if (handle->fetchingRows) {
+        (void) Ns_DbFlush(handle);
+    }
+    if (writerPtr->failed || !ODBCWriterFlush(writerPtr)) {
+        ns_free(writerPtr);
+        ns_free(sql);
+        if (chan != NULL) {
+            Tcl_AppendResult(interp, "error writing \"", Tcl_GetChannelName(chan),
+                             "\": ", Tcl_PosixError(interp), NULL);
+        } else {
+            Tcl_AppendResult(interp, "could not send data to connection", NULL);
+        }
+        return TCL_ERROR;
+    }
+    ns_free(writerPtr);
+
+    if (status == NS_ERROR) {
+        return DbFail(interp, handle, argv[1], sql);
+    }
+    ns_free(sql);
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(nrows));
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCParseCsvLine --
+ *
+ *      Split the line starting at "p" into fields. Each field is
+ *      returned as its start and size in the buffer, quoted fields
+ *      including their quotes; they are unquoted when copied (see
+ *      ODBCCopyField), so the buffer is never modified.
+ *
+ * Results:
+ *      Start of the next line. The number of fields is returned in
+ *      nfieldsPtr, the fields in *fieldsPtr and their sizes in
+ *      *sizesPtr, which are grown as needed.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+ODBCParseCsvLine(const char *p, const char *end, char delimiter, char quote,
+                 const char ***fieldsPtr, size_t **sizesPtr, int *maxFieldsPtr,
+                 int *nfieldsPtr)
+{
+    int nfields = 0;
+
+    for (;;) {
+        const char *field = p;
+
+        if (p < end && *p == quote && quote != '\0') {
+            for (p++; p < end; p++) {
+                if (*p != quote) {
+                    continue;
+                } else if (p + 1 < end && p[1] == quote) {
+                    p++;
+                } else {
+                    p++;
+                    break;
+                }
+            }
+        }
+        while (p < end && *p != delimiter && *p != '\n' && *p != '\r') {
+            p++;
+        }
+        if (nfields == *maxFieldsPtr) {
+            *maxFieldsPtr = (*maxFieldsPtr + 8) * 2;
+            *fieldsPtr = ns_realloc(*fieldsPtr, (size_t)*maxFieldsPtr * sizeof(char *));
+            *sizesPtr = ns_realloc(*sizesPtr, (size_t)*maxFieldsPtr * sizeof(size_t));
+        }
+        (*fieldsPtr)[nfields] = field;
+        (*sizesPtr)[nfields++] = (size_t)(p - field);
+        if (p == end) {
+            break;
+        } else if (*p == delimiter) {
+            p++;
+        } else {
+            if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+                p++;
+            }
+            p++;
+            break;
+        }
+    }
+    *nfieldsPtr = nfields;
+
+    return p;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCCopyField --
+ *
+ *      Copy a field of ODBCParseCsvLine to "dest", which must have room
+ *      for "size" + 1 bytes. A field starting with "quote" is unquoted:
+ *      doubled quotes are copied as one, the closing quote and the
+ *      rest of the field are dropped.
+ *
+ * Results:
+ *      Length of the NUL terminated copy.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static size_t
+ODBCCopyField(char *dest, const char *value, size_t size, char quote)
+{
+    const char *p, *end = value + size;
+    size_t      length = 0u;
+
+    if (quote == '\0' || size == 0u || *value != quote) {
+        memcpy(dest, value, size);
+        length = size;
+    } else {
+        for (p = value + 1; p < end; p++) {
+            if (*p != quote) {
+                dest[length++] = *p;
+            } else if (p + 1 < end && p[1] == quote) {
+                dest[length++] = *p++;
+            } else {
+                break;
+            }
+        }
+    }
+    dest[length] = '\0';
+
+    return length;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCLoadChunk --
+ *
+ *      Insert a chunk of rows collected by ns_odbc load, in a
+ *      transaction of its own.
+ *
+ * Results:
+ *      Number of rows inserted.
+ *
+ * Side effects:
+ *      Commits or rolls back the transaction.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCLoadChunk(Ns_DbHandle *handle, int nparams, int nrows, const char **values,
+              const size_t *sizes, char quote, SQLUSMALLINT *status)
+{
+    const OdbcConn *connPtr = handle->connection;
+    SQLRETURN       rc;
+    int             i, loaded = 0;
+
+    (void) ODBCExecChunk(handle, nparams, nrows, values, sizes, quote, status);
+    for (i = 0; i < nrows; i++) {
+        if (status[i] == SQL_PARAM_SUCCESS || status[i] == SQL_PARAM_SUCCESS_WITH_INFO) {
+            loaded++;
+        }
+    }
+    if (connPtr->inTransaction) {
+        /*
+         * Committed together with the enclosing transaction.
+         */
+        return loaded;
+    }
+    rc = SQLEndTran(SQL_HANDLE_DBC, connPtr->hdbc, SQL_COMMIT);
+    ODBCLog(rc, handle);
+    if (!RC_OK(rc)) {
+        (void) SQLEndTran(SQL_HANDLE_DBC, connPtr->hdbc, SQL_ROLLBACK);
+        loaded = 0;
+    }
+
+    return loaded;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCLoadCmd --
+ *
+ *      Implements "ns_odbc load dbId table file ?-columns list?
+ *      ?-header? ?-batch n? ?-delimiter c? ?-quote c?". The file is
+ *      mapped read-only into memory and parsed in place; the rows are inserted
+ *      with a prepared INSERT statement, "batch" rows at a time as
+ *      parameter arrays, each batch in a transaction of its own.
+ *      Without "-columns", the column names are taken from the first
+ *      line ("-header") or the values are inserted in table order.
+ *
+ * Results:
+ *      Standard Tcl result; a dict with the number of rows inserted
+ *      ("loaded") and rejected ("rejected"), i.e. rows with the wrong
+ *      number of fields or refused by the database.
+ *
+ * Side effects:
+ *      Inserts rows into the table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCLoadCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    OdbcConn       *connPtr;
+    Ns_DString      ds, name;
+    struct stat     st;
+    const char    **columnv = NULL, **values = NULL, **fields = NULL, *p, *end;
+    size_t         *sizes = NULL, *valueSizes = NULL;
+    char           *data = NULL, *sql = NULL, delimiter = ',', quote = '"';
+    SQLUSMALLINT   *status = NULL;
+    SQLRETURN       rc;
+    Tcl_Obj        *resultObj;
+    bool            header = NS_FALSE;
+    int             fd, argi, i, nrows = 0, nfields, maxFields = 0, nparams = 0;
+    int             batchSize = 0, result = TCL_OK;
+    Tcl_WideInt     loaded = 0, rejected = 0;
+
+    for (argi = 5; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-header")) {
+            header = NS_TRUE;
+        } else if (argi + 1 == argc) {
+            break;
+        } else if (STREQ(argv[argi], "-columns") && columnv == NULL) {
+            if (Tcl_SplitList(interp, argv[++argi], &nparams, &columnv) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if (STREQ(argv[argi], "-batch")) {
+            if (Tcl_GetInt(interp, argv[++argi], &batchSize) != TCL_OK) {
+                result = TCL_ERROR;
+                break;
+            }
+        } else if (STREQ(argv[argi], "-delimiter") && strlen(argv[argi + 1]) == 1u) {
+            delimiter = *argv[++argi];
+        } else if (STREQ(argv[argi], "-quote") && strlen(argv[argi + 1]) <= 1u) {
+            quote = *argv[++argi];
+        } else {
+            break;
+        }
+    }
+    if (result == TCL_OK && (argc < 5 || argi != argc || batchSize < 0
+                             || (columnv != NULL && nparams == 0))) {
+        result = BadArgs(interp, argv, "dbId table file ?-columns list? ?-header? "
+                         "?-batch n? ?-delimiter c? ?-quote c?");
+    }
+    if (result != TCL_OK || ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        ckfree((char *)columnv);
+        return TCL_ERROR;
+    }
+    connPtr = handle->connection;
+    if (batchSize == 0) {
+        batchSize = connPtr->poolPtr->batchSize;
+    }
+
+    /*
+     * Map the file. The parser leaves it untouched, so that the pages
+     * stay shared with the page cache.
+     */
+    fd = ns_open(argv[4], O_RDONLY | O_BINARY, 0);
+    if (fd == NS_INVALID_FD || fstat(fd, &st) != 0) {
+        Tcl_AppendResult(interp, "could not open \"", argv[4], "\": ",
+                         Tcl_PosixError(interp), NULL);
+        if (fd != NS_INVALID_FD) {
+            (void) ns_close(fd);
+        }
+        ckfree((char *)columnv);
+        return TCL_ERROR;
+    }
+    if (st.st_size > 0) {
+#ifndef _WIN32
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        } else {
+            (void) madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        }
+#else
+        data = ns_malloc((size_t)st.st_size);
+        if (ns_read(fd, data, (size_t)st.st_size) != (ssize_t)st.st_size) {
+            ns_free(data);
+            data = NULL;
+        }
+#endif
+        if (data == NULL) {
+            Tcl_AppendResult(interp, "could not read \"", argv[4], "\": ",
+                             Tcl_PosixError(interp), NULL);
+            (void) ns_close(fd);
+            ckfree((char *)columnv);
+            return TCL_ERROR;
+        }
+    }
+    (void) ns_close(fd);
+
+    p = data;
+    end = data + st.st_size;
+
+    Ns_DStringInit(&ds);
+    Ns_DStringInit(&name);
+    Ns_DStringVarAppend(&ds, "insert into ", argv[3], NULL);
+    for (i = 0; i < nparams; i++) {
+        Ns_DStringVarAppend(&ds, (i == 0) ? " (" : ", ", columnv[i], NULL);
+    }
+    if (nparams > 0) {
+        Ns_DStringNAppend(&ds, ")", 1);
+    }
+
+    while (result == TCL_OK && p < end) {
+        p = ODBCParseCsvLine(p, end, delimiter, quote, &fields, &sizes, &maxFields,
+                             &nfields);
+
+        if (header) {
+            /*
+             * Take the column names from the first line, unless given
+             * explicitly. They end up in the SQL, so accept plain
+             * identifiers only.
+             */
+            header = NS_FALSE;
+            for (i = 0; columnv == NULL && i < nfields; i++) {
+                const char *c;
+
+                Ns_DStringSetLength(&name, (int)sizes[i]);
+                Ns_DStringSetLength(&name, (int)ODBCCopyField(name.string, fields[i],
+                                                             sizes[i], quote));
+                for (c = name.string; *c != '\0' && BINDCHAR(*c); c++) {
+                    ;
+                }
+                if (c == name.string || *c != '\0') {
+                    Tcl_AppendResult(interp, "invalid column name \"", name.string,
+                                     "\" in header of \"", argv[4], "\"", NULL);
+                    result = TCL_ERROR;
+                    break;
+                }
+                Ns_DStringVarAppend(&ds, (i == 0) ? " (" : ", ", name.string, NULL);
+            }
+            if (columnv == NULL && result == TCL_OK) {
+                Ns_DStringNAppend(&ds, ")", 1);
+                nparams = nfields;
+            }
+            continue;
+        }
+        if (nfields == 1 && sizes[0] == 0u) {
+            continue;
+        }
+
+        if (sql == NULL) {
+            /*
+             * First data line: without column names, its number of
+             * fields determines the number of values. Prepare the
+             * statement and switch to manual commit.
+             */
+            if (nparams == 0) {
+                nparams = nfields;
+            }
+            Ns_DStringNAppend(&ds, " values (", 9);
+            for (i = 0; i < nparams; i++) {
+                Ns_DStringNAppend(&ds, (i == 0) ? "?" : ", ?", (i == 0) ? 1 : 3);
+            }
+            Ns_DStringNAppend(&ds, ")", 1);
+            sql = Ns_DStringExport(&ds);
+
+            if (handle->statement != NULL) {
+                (void) ODBCFreeStmt(handle);
+            }
+            rc = ODBCPrepareStmt(handle, sql);
+            if (RC_OK(rc) && !connPtr->inTransaction) {
+                rc = SQLSetConnectAttr(connPtr->hdbc, SQL_ATTR_AUTOCOMMIT,
+                                       (SQLPOINTER)SQL_AUTOCOMMIT_OFF, 0);
+                ODBCLog(rc, handle);
+            }
+            if (!RC_OK(rc)) {
+                if (handle->statement != NULL) {
+                    (void) ODBCFreeStmt(handle);
+                }
+                result = TCL_ERROR;
+                break;
+            }
+            values = ns_malloc((size_t)batchSize * (size_t)nparams * sizeof(char *) + 1u);
+            valueSizes = ns_malloc((size_t)batchSize * (size_t)nparams * sizeof(size_t) + 1u);
+            status = ns_malloc((size_t)batchSize * sizeof(SQLUSMALLINT) + 1u);
+        }
+
+        if (nfields != nparams) {
+            rejected++;
+            continue;
+        }
+        memcpy(&values[nrows * nparams], fields, (size_t)nparams * sizeof(char *));
+        memcpy(&valueSizes[nrows * nparams], sizes, (size_t)nparams * sizeof(size_t));
+        if (++nrows == batchSize) {
+            int n = ODBCLoadChunk(handle, nparams, nrows, values, valueSizes, quote, status);
+
+            loaded += n;
+            rejected += nrows - n;
+            nrows = 0;
+        }
+    }
+    if (nrows > 0) {
+        int n = ODBCLoadChunk(handle, nparams, nrows, values, valueSizes, quote, status);
+
+        loaded += n;
+        rejected += nrows - n;
+    }
+    if (handle->statement != NULL) {
+        (void) ODBCFreeStmt(handle);
+        if (!connPtr->inTransaction) {
+            (void) SQLSetConnectAttr(connPtr->hdbc, SQL_ATTR_AUTOCOMMIT,
+                                     (SQLPOINTER)SQL_AUTOCOMMIT_ON, 0);
+        }
+    }
+
+    Ns_DStringFree(&ds);
+    Ns_DStringFree(&name);
+    ns_free(values);
+    ns_free(valueSizes);
+    ns_free(status);
+    ns_free(fields);
+    ns_free(sizes);
+    ckfree((char *)columnv);
+    if (data != NULL) {
+#ifndef _WIN32
+        (void) munmap(data, (size_t)st.st_size);
+#else
+        ns_free(data);
+#endif
+    }
+
+    if (result != TCL_OK) {
+        if (sql != NULL) {
+            return DbFail(interp, handle, argv[1], sql);
+        }
+        return TCL_ERROR;
+    }
+    ns_free(sql);
+    resultObj = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("loaded", 6), Tcl_NewWideIntObj(loaded));
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("rejected", 8), Tcl_NewWideIntObj(rejected));
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAsyncExecCmd --
+ *
+ *      Implements "ns_odbc exec -async pool sql ?-callback script?".
+ *      The statement is queued for the driver worker threads (driver
+ *      parameter "asyncthreads"), which run it on a handle of the
+ *      pool. The calling thread continues immediately, so several
+ *      statements may run concurrently. With "-callback", the script
+ *      is evaluated with the job id appended in an interpreter of the
+ *      worker thread when the statement is finished.
+ *
+ * Results:
+ *      Standard Tcl result; the job id for "ns_odbc wait".
+ *
+ * Side effects:
+ *      May start a worker thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCAsyncExecCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    OdbcJob    *jobPtr;
+    const char *server = Ns_TclInterpServer(interp);
+    char        id[TCL_INTEGER_SPACE + 8];
+    int         isNew;
+    Ns_Thread  *threadPtr = NULL;
+
+    if ((argc != 5 && argc != 7) || !STREQ(argv[2], "-async")
+        || (argc == 7 && !STREQ(argv[5], "-callback"))) {
+        return BadArgs(interp, argv, "-async pool sql ?-callback script?");
+    }
+    if (server == NULL || !Ns_DbPoolAllowable(server, argv[3])) {
+        Tcl_AppendResult(interp, "no access to pool: \"", argv[3], "\"", NULL);
+        return TCL_ERROR;
+    }
+
+    jobPtr = ns_calloc(1u, sizeof(OdbcJob));
+    jobPtr->server = server;
+    jobPtr->pool = ns_strdup(argv[3]);
+    jobPtr->sql = ns_strdup(argv[4]);
+    jobPtr->script = (argc == 7) ? ns_strdup(argv[6]) : NULL;
+    Ns_DStringInit(&jobPtr->result);
+
+    Ns_MutexLock(&async.lock);
+    if (async.shutdown) {
+        Ns_MutexUnlock(&async.lock);
+        ODBCFreeJob(jobPtr);
+        Tcl_AppendResult(interp, "server shutting down", NULL);
+        return TCL_ERROR;
+    }
+    snprintf(id, sizeof(id), "odbcjob%lu", async.nextId++);
+    jobPtr->hPtr = Tcl_CreateHashEntry(&async.jobs, id, &isNew);
+    Tcl_SetHashValue(jobPtr->hPtr, jobPtr);
+    if (async.lastPtr != NULL) {
+        async.lastPtr->nextPtr = jobPtr;
+    } else {
+        async.firstPtr = jobPtr;
+    }
+    async.lastPtr = jobPtr;
+    if (async.numIdle == 0 && async.numStarted < async.maxThreads) {
+        async.numThreads++;
+        threadPtr = &async.threads[async.numStarted++];
+    } else {
+        Ns_CondSignal(&async.queueCond);
+    }
+    Ns_MutexUnlock(&async.lock);
+
+    if (threadPtr != NULL) {
+        Ns_ThreadCreate(ODBCAsyncThread, NULL, 0, threadPtr);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(id, -1));
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAsyncWaitCmd --
+ *
+ *      Implements "ns_odbc wait jobId ?-timeout time?". Waits until
+ *      the job is finished and collects its result.
+ *
+ * Results:
+ *      Standard Tcl result; a dict with the column names ("columns")
+ *      and rows ("rows"), both empty for DML statements. The error of
+ *      a failed statement is raised as error. On timeout, the job is
+ *      left in place and an error with error code NS_TIMEOUT is
+ *      raised.
+ *
+ * Side effects:
+ *      The job is freed once the result is returned.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCAsyncWaitCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Tcl_HashEntry *hPtr;
+    OdbcJob       *jobPtr = NULL;
+    Ns_Time        timeout, *timeoutPtr = NULL;
+    Ns_ReturnCode  status = NS_OK;
+    int            result;
+
+    if (argc == 5 && STREQ(argv[3], "-timeout")) {
+        Tcl_Obj *objPtr = Tcl_NewStringObj(argv[4], -1);
+
+        Tcl_IncrRefCount(objPtr);
+        result = Ns_TclGetTimeFromObj(interp, objPtr, &timeout);
+        Tcl_DecrRefCount(objPtr);
+        if (result != TCL_OK) {
+            return TCL_ERROR;
+        }
+        timeoutPtr = Ns_AbsoluteTime(&timeout, &timeout);
+    } else if (argc != 3) {
+        return BadArgs(interp, argv, "jobId ?-timeout time?");
+    }
+
+    Ns_MutexLock(&async.lock);
+    while (status == NS_OK) {
+        hPtr = Tcl_FindHashEntry(&async.jobs, argv[2]);
+        if (hPtr == NULL) {
+            break;
+        }
+        jobPtr = Tcl_GetHashValue(hPtr);
+        if (jobPtr->done) {
+            Tcl_DeleteHashEntry(hPtr);
+            jobPtr->hPtr = NULL;
+            break;
+        }
+        jobPtr = NULL;
+        if (timeoutPtr != NULL) {
+            status = Ns_CondTimedWait(&async.doneCond, &async.lock, timeoutPtr);
+        } else {
+            Ns_CondWait(&async.doneCond, &async.lock);
+        }
+    }
+    Ns_MutexUnlock(&async.lock);
+
+    if (status == NS_TIMEOUT) {
+        Tcl_SetErrorCode(interp, "NS_TIMEOUT", NULL);
+        Tcl_AppendResult(interp, "timeout waiting for job \"", argv[2], "\"", NULL);
+        return TCL_ERROR;
+    }
+    if (jobPtr == NULL) {
+        Tcl_AppendResult(interp, "no such job: \"", argv[2], "\"", NULL);
+        return TCL_ERROR;
+    }
+
+    result = ODBCJobResult(interp, jobPtr);
+    ODBCFreeJob(jobPtr);
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCJobResult --
+ *
+ *      Convert the result of a finished job to a Tcl result.
+ *
+ * Results:
+ *      TCL_OK with a dict with the column names ("columns") and rows
+ *      ("rows"), both empty for DML statements, or TCL_ERROR with the
+ *      error message of the statement.
+ *
+ * Side effects:
+ *      Empties the result of the job.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCJobResult(Tcl_Interp *interp, OdbcJob *jobPtr)
+{
+    Tcl_Obj    *columnsObj, *rowsObj, *resultObj;
+    const char *p;
+    Tcl_WideInt i;
+    int         j;
+
+    if (jobPtr->status != TCL_OK) {
+        Tcl_SetErrorCode(interp, "ODBC", jobPtr->exceptionCode, NULL);
+        Tcl_DStringResult(interp, &jobPtr->result);
+        return TCL_ERROR;
+    }
+
+    p = Ns_DStringValue(&jobPtr->result);
+    columnsObj = Tcl_NewListObj(0, NULL);
+    for (j = 0; j < jobPtr->numCols; j++) {
+        Tcl_ListObjAppendElement(NULL, columnsObj, Tcl_NewStringObj(p, -1));
+        p += strlen(p) + 1u;
+    }
+    rowsObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < jobPtr->numRows; i++) {
+        Tcl_Obj *rowObj = Tcl_NewListObj(0, NULL);
+
+        for (j = 0; j < jobPtr->numCols; j++) {
+            size_t length = strlen(p);
+
+            Tcl_ListObjAppendElement(NULL, rowObj, Tcl_NewStringObj(p, (int)length));
+            p += length + 1u;
+        }
+        Tcl_ListObjAppendElement(NULL, rowsObj, rowObj);
+    }
+    Ns_DStringFree(&jobPtr->result);
+
+    resultObj = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("columns", 7), columnsObj);
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("rows", 4), rowsObj);
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCParallelCmd --
+ *
+ *      Implements "ns_odbc parallel -pool name ?-timeout time? sqls".
+ *      Up to one handle per statement is taken from the pool, as many
+ *      as are available without waiting, but at least one (waiting at
+ *      most "-timeout", by default the "gethandletimeout" of the
+ *      pool). The statements are distributed over the
+ *      handles and run concurrently, by the calling thread and one
+ *      helper thread per additional handle. Since all handles are
+ *      requested at once and no handle is held while waiting, an
+ *      exhausted pool cannot deadlock.
+ *
+ * Results:
+ *      Standard Tcl result; a list with one dict per statement, in the
+ *      order of the statements, as returned by "ns_odbc wait". If a
+ *      statement fails, the error of the first failed statement is
+ *      raised.
+ *
+ * Side effects:
+ *      Starts and joins threads.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCParallelCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    OdbcParallel    parallel;
+    Ns_DbHandle   **handles;
+    Ns_Thread      *threads;
+    Ns_Time         timeout, nowait = {0, 0};
+    Tcl_HashEntry  *hPtr;
+    bool            haveTimeout = NS_FALSE;
+    Ns_ReturnCode   status = NS_ERROR;
+    Tcl_Obj        *resultObj;
+    const char     *server = Ns_TclInterpServer(interp), *pool = NULL, **sqlv;
+    int             argi, i, n, nhandles, result = TCL_OK;
+
+    for (argi = 2; argi < argc - 1; argi++) {
+        if (STREQ(argv[argi], "-pool") && argi + 2 < argc) {
+            pool = argv[++argi];
+        } else if (STREQ(argv[argi], "-timeout") && argi + 2 < argc) {
+            Tcl_Obj *objPtr = Tcl_NewStringObj(argv[++argi], -1);
+
+            Tcl_IncrRefCount(objPtr);
+            result = Ns_TclGetTimeFromObj(interp, objPtr, &timeout);
+            Tcl_DecrRefCount(objPtr);
+            if (result != TCL_OK) {
+                return TCL_ERROR;
+            }
+            haveTimeout = NS_TRUE;
+        } else {
+            break;
+        }
+    }
+    if (argi != argc - 1 || pool == NULL) {
+        return BadArgs(interp, argv, "-pool name ?-timeout time? sqls");
+    }
+    if (server == NULL || !Ns_DbPoolAllowable(server, pool)) {
+        Tcl_AppendResult(interp, "no access to pool: \"", pool, "\"", NULL);
+        return TCL_ERROR;
+    }
+    if (!haveTimeout) {
+        ODBCHandleTimeout(pool, &timeout);
+    }
+    if (Tcl_SplitList(interp, argv[argc - 1], &n, &sqlv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (n == 0) {
+        ckfree((char *)sqlv);
+        return TCL_OK;
+    }
+
+    /*
+     * Asking nsdb for more handles than the pool has is logged as an
+     * error, so start with at most the size of the pool.
+     */
+    nhandles = n;
+    Ns_MutexLock(&poolsLock);
+    hPtr = Tcl_FindHashEntry(&poolsTable, pool);
+    if (hPtr != NULL) {
+        const OdbcPool *poolPtr = Tcl_GetHashValue(hPtr);
+
+        if (poolPtr->connections > 0 && nhandles > poolPtr->connections) {
+            nhandles = poolPtr->connections;
+        }
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    handles = ns_calloc((size_t)n, sizeof(Ns_DbHandle *));
+    for (; nhandles > 1 && status != NS_OK; nhandles--) {
+        status = Ns_DbPoolTimedGetMultipleHandles(handles, pool, nhandles, &nowait);
+        if (status == NS_OK) {
+            break;
+        }
+    }
+    if (status != NS_OK) {
+        nhandles = 1;
+        status = Ns_DbPoolTimedGetMultipleHandles(handles, pool, 1, &timeout);
+    }
+    if (status != NS_OK) {
+        ns_free(handles);
+        ckfree((char *)sqlv);
+        if (status == NS_TIMEOUT) {
+            Tcl_SetErrorCode(interp, "NS_TIMEOUT", NULL);
+            Tcl_AppendResult(interp, "wait for database operation timed out", NULL);
+        } else {
+            Tcl_AppendResult(interp, "could not get handle from pool \"", pool, "\"", NULL);
+        }
+        return TCL_ERROR;
+    }
+
+    memset(&parallel, 0, sizeof(parallel));
+    parallel.jobs = ns_calloc((size_t)n, sizeof(OdbcJob));
+    parallel.numJobs = n;
+    for (i = 0; i < n; i++) {
+        parallel.jobs[i].sql = (char *)sqlv[i];
+        Ns_DStringInit(&parallel.jobs[i].result);
+    }
+    Ns_MutexSetName2(&parallel.lock, "nsodbc", "parallel");
+    parallel.handles = handles;
+
+    threads = ns_calloc((size_t)nhandles, sizeof(Ns_Thread));
+    for (i = 1; i < nhandles; i++) {
+        Ns_ThreadCreate(ODBCParallelThread, &parallel, 0, &threads[i]);
+    }
+    ODBCRunJobs(&parallel, handles[0]);
+    for (i = 1; i < nhandles; i++) {
+        Ns_ThreadJoin(&threads[i], NULL);
+    }
+    ns_free(threads);
+    for (i = 0; i < nhandles; i++) {
+        Ns_DbPoolPutHandle(handles[i]);
+    }
+    ns_free(handles);
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < n; i++) {
+        if (result == TCL_OK) {
+            result = ODBCJobResult(interp, &parallel.jobs[i]);
+            if (result == TCL_OK) {
+                Tcl_ListObjAppendElement(NULL, resultObj, Tcl_GetObjResult(interp));
+            }
+        }
+        Ns_DStringFree(&parallel.jobs[i].result);
+    }
+    Ns_MutexDestroy(&parallel.lock);
+    ns_free(parallel.jobs);
+    ckfree((char *)sqlv);
+
+    if (result != TCL_OK) {
+        Tcl_DecrRefCount(resultObj);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCParallelThread, ODBCRunJobs --
+ *
+ *      Helper thread of "ns_odbc parallel": run statements on the
+ *      handle with the index of the thread until all statements are
+ *      taken.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCParallelThread(void *arg)
+{
+    OdbcParallel *parPtr = arg;
+    int           i;
+
+    Ns_ThreadSetName("-odbc-parallel-");
+
+    /*
+     * Claim a handle: the caller uses the first one.
+     */
+    Ns_MutexLock(&parPtr->lock);
+    i = ++parPtr->nextHandle;
+    Ns_MutexUnlock(&parPtr->lock);
+
+    ODBCRunJobs(parPtr, parPtr->handles[i]);
+}
+
+static void
+ODBCRunJobs(OdbcParallel *parPtr, Ns_DbHandle *handle)
+{
+    while (NS_TRUE) {
+        int i;
+
+        Ns_MutexLock(&parPtr->lock);
+        i = parPtr->nextJob++;
+        Ns_MutexUnlock(&parPtr->lock);
+        if (i >= parPtr->numJobs) {
+            break;
+        }
+        ODBCRunJob(&parPtr->jobs[i], handle);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAsyncThread --
+ *
+ *      Worker thread for "ns_odbc exec -async": runs the queued jobs
+ *      and their callbacks.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Drops expired results. Exits on server shutdown.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCAsyncThread(void *UNUSED(arg))
+{
+    Ns_DString   ds;
+    OdbcJob     *jobPtr;
+    Ns_DbHandle *handle;
+    Ns_Time      now, wait;
+
+    Ns_ThreadSetName("-odbc-async-");
+    Ns_DStringInit(&ds);
+
+    Ns_MutexLock(&async.lock);
+    while (!async.shutdown) {
+        const char *server;
+
+        jobPtr = async.firstPtr;
+        if (jobPtr == NULL) {
+            async.numIdle++;
+            Ns_CondWait(&async.queueCond, &async.lock);
+            async.numIdle--;
+            continue;
+        }
+        async.firstPtr = jobPtr->nextPtr;
+        if (async.firstPtr == NULL) {
+            async.lastPtr = NULL;
+        }
+        Ns_MutexUnlock(&async.lock);
+
+        ODBCHandleTimeout(jobPtr->pool, &wait);
+        handle = Ns_DbPoolTimedGetHandle(jobPtr->pool, &wait);
+        if (handle == NULL) {
+            Ns_DStringVarAppend(&jobPtr->result, "could not get handle from pool \"",
+                                jobPtr->pool, "\" within gethandletimeout", NULL);
+            strcpy(jobPtr->exceptionCode, "HYT00");
+            jobPtr->status = TCL_ERROR;
+        } else {
+            ODBCRunJob(jobPtr, handle);
+            Ns_DbPoolPutHandle(handle);
+        }
+
+        /*
+         * The job may be collected and freed as soon as it is marked
+         * done, so take what the callback needs first.
+         */
+        server = jobPtr->server;
+        Ns_DStringSetLength(&ds, 0);
+        Ns_GetTime(&now);
+        Ns_MutexLock(&async.lock);
+        if (jobPtr->script != NULL) {
+            Ns_DStringVarAppend(&ds, jobPtr->script, " ",
+                                Tcl_GetHashKey(&async.jobs, jobPtr->hPtr), NULL);
+        }
+        jobPtr->done = NS_TRUE;
+        jobPtr->expires = now;
+        Ns_IncrTime(&jobPtr->expires, async.resultTimeout.sec, async.resultTimeout.usec);
+        Ns_CondBroadcast(&async.doneCond);
+        if (Ns_DiffTime(&now, &async.nextSweep, NULL) >= 0) {
+            ODBCSweepJobs(&now);
+        }
+        Ns_MutexUnlock(&async.lock);
+
+        if (Ns_DStringLength(&ds) > 0) {
+            Tcl_Interp *interp = Ns_TclAllocateInterp(server);
+
+            if (interp != NULL) {
+                const char *id = strrchr(ds.string, ' ') + 1;
+                Tcl_HashEntry *hPtr;
+
+                if (Tcl_EvalEx(interp, ds.string, -1, 0) != TCL_OK) {
+                    (void) Ns_TclLogErrorInfo(interp, "\n(context: ns_odbc callback)");
+                }
+                Ns_TclDeAllocateInterp(interp);
+
+                /*
+                 * Results not collected by the callback are dropped.
+                 */
+                Ns_MutexLock(&async.lock);
+                hPtr = Tcl_FindHashEntry(&async.jobs, id);
+                jobPtr = NULL;
+                if (hPtr != NULL) {
+                    jobPtr = Tcl_GetHashValue(hPtr);
+                    Tcl_DeleteHashEntry(hPtr);
+                }
+                Ns_MutexUnlock(&async.lock);
+                if (jobPtr != NULL) {
+                    ODBCFreeJob(jobPtr);
+                }
+            }
+        }
+        Ns_MutexLock(&async.lock);
+    }
+    async.numThreads--;
+    Ns_CondBroadcast(&async.doneCond);
+    Ns_MutexUnlock(&async.lock);
+
+    Ns_DStringFree(&ds);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCSweepJobs --
+ *
+ *      Drop the results of finished jobs which were not collected
+ *      within the driver parameter "asyncresulttimeout". Called with
+ *      the async lock held, at most twice per timeout.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees the expired jobs.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCSweepJobs(const Ns_Time *nowPtr)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    int             dropped = 0;
+
+    for (hPtr = Tcl_FirstHashEntry(&async.jobs, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        OdbcJob *jobPtr = Tcl_GetHashValue(hPtr);
+
+        if (jobPtr->done && Ns_DiffTime(&jobPtr->expires, nowPtr, NULL) < 0) {
+            Tcl_DeleteHashEntry(hPtr);
+            ODBCFreeJob(jobPtr);
+            dropped++;
+        }
+    }
+    if (dropped > 0) {
+        Ns_Log(Warning, "nsodbc: dropped %d uncollected async results", dropped);
+    }
+    async.nextSweep = *nowPtr;
+    Ns_IncrTime(&async.nextSweep, async.resultTimeout.sec / 2,
+                async.resultTimeout.usec / 2 + (async.resultTimeout.sec % 2) * 500000);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCRunJob --
+ *
+ *      Run the statement of a job on the given handle and keep the
+ *      result.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets the status and result of the job.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCRunJob(OdbcJob *jobPtr, Ns_DbHandle *handle)
+{
+    Ns_Set      *row;
+    int          status;
+
+    status = Ns_DbExec(handle, jobPtr->sql);
+    if (status == NS_ROWS) {
+        row = Ns_DbBindRow(handle);
+        if (row == NULL) {
+            status = NS_ERROR;
+        } else {
+            size_t i;
+
+            jobPtr->numCols = (int)Ns_SetSize(row);
+            for (i = 0u; i < Ns_SetSize(row); i++) {
+                const char *key = Ns_SetKey(row, i);
+
+                Ns_DStringNAppend(&jobPtr->result, key, (int)strlen(key) + 1);
+            }
+            while ((status = Ns_DbGetRow(handle, row)) == NS_OK) {
+                for (i = 0u; i < Ns_SetSize(row); i++) {
+                    const char *value = Ns_SetValue(row, i);
+
+                    Ns_DStringNAppend(&jobPtr->result, value, (int)strlen(value) + 1);
+                }
+                jobPtr->numRows++;
+            }
+            if (status == NS_END_DATA) {
+                status = NS_OK;
+            }
+        }
+    } else if (status == NS_DML) {
+        status = NS_OK;
+    }
+
+    if (status != NS_OK) {
+        Ns_DStringSetLength(&jobPtr->result, 0);
+        Ns_DStringVarAppend(&jobPtr->result, "Database operation \"exec\" failed", NULL);
+        if (handle->cExceptionCode[0] != '\0') {
+            memcpy(jobPtr->exceptionCode, handle->cExceptionCode, sizeof(jobPtr->exceptionCode));
+            Ns_DStringVarAppend(&jobPtr->result, " (exception ", handle->cExceptionCode, NULL);
+            if (handle->dsExceptionMsg.length > 0) {
+                Ns_DStringVarAppend(&jobPtr->result, ", \"",
+                                    handle->dsExceptionMsg.string, "\"", NULL);
+            }
+            Ns_DStringNAppend(&jobPtr->result, ")", 1);
+        }
+        jobPtr->numCols = 0;
+        jobPtr->numRows = 0;
+        jobPtr->status = TCL_ERROR;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCFreeJob --
+ *
+ *      Free an async job.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCFreeJob(OdbcJob *jobPtr)
+{
+    Ns_DStringFree(&jobPtr->result);
+    ns_free(jobPtr->pool);
+    ns_free(jobPtr->sql);
+    ns_free(jobPtr->script);
+    ns_free(jobPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCTimeoutCmd --
+ *
+ *      Implements "ns_odbc timeout dbId ?seconds?". Overrides the
+ *      query timeout of the pool ("querytimeout") for the statements
+ *      of the handle until it is returned to the pool; 0 disables the
+ *      timeout.
+ *
+ * Results:
+ *      Standard Tcl result; the query timeout of the handle.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCTimeoutCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    OdbcConn       *connPtr;
+    int             timeout;
+
+    if (argc != 3 && argc != 4) {
+        return BadArgs(interp, argv, "dbId ?seconds?");
+    }
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    connPtr = handle->connection;
+    if (argc == 4) {
+        if (Tcl_GetInt(interp, argv[3], &timeout) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (timeout < 0) {
+            Tcl_AppendResult(interp, "invalid timeout \"", argv[3], "\"", NULL);
+            return TCL_ERROR;
+        }
+        connPtr->queryTimeout = timeout;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(ODBCQueryTimeout(connPtr)));
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCBeginTran --
+ *
+ *      Start a transaction by switching off autocommit.
+ *
+ * Results:
+ *      ODBC return code.
+ *
+ * Side effects:
+ *      Frees a pending statement.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCBeginTran(Ns_DbHandle *handle)
+{
+    OdbcConn  *connPtr = handle->connection;
+    SQLRETURN  rc;
+
+    if (handle->statement != NULL) {
+        (void) ODBCFreeStmt(handle);
+    }
+    rc = SQLSetConnectAttr(connPtr->hdbc, SQL_ATTR_AUTOCOMMIT,
+                           (SQLPOINTER)SQL_AUTOCOMMIT_OFF, 0);
+    ODBCLog(rc, handle);
+    if (RC_OK(rc)) {
+        connPtr->inTransaction = NS_TRUE;
+    }
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCEndTran --
+ *
+ *      Commit or roll back the transaction of the handle and switch
+ *      autocommit back on. Autocommit is restored even when the
+ *      commit fails; the transaction is rolled back then.
+ *
+ * Results:
+ *      ODBC return code of the commit or rollback.
+ *
+ * Side effects:
+ *      Frees a pending statement.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCEndTran(Ns_DbHandle *handle, SQLSMALLINT completion)
+{
+    OdbcConn  *connPtr = handle->connection;
+    SQLRETURN  rc, rc2;
+
+    if (handle->statement != NULL) {
+        (void) ODBCFreeStmt(handle);
+    }
+    rc = SQLEndTran(SQL_HANDLE_DBC, connPtr->hdbc, completion);
+    ODBCLog(rc, handle);
+    if (!RC_OK(rc) && completion == SQL_COMMIT) {
+        (void) SQLEndTran(SQL_HANDLE_DBC, connPtr->hdbc, SQL_ROLLBACK);
+    }
+    rc2 = SQLSetConnectAttr(connPtr->hdbc, SQL_ATTR_AUTOCOMMIT,
+                            (SQLPOINTER)SQL_AUTOCOMMIT_ON, 0);
+    if (!RC_OK(rc2)) {
+        Ns_Log(Error, "%s[%s]: could not restore autocommit mode",
+               handle->driver, handle->poolname);
+    }
+    connPtr->inTransaction = NS_FALSE;
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCTransactionCmd --
+ *
+ *      Implements "ns_odbc transaction begin|commit|rollback dbId" and
+ *      "ns_odbc transaction dbId script". The latter evaluates the
+ *      script in a transaction, which is committed when the script
+ *      completes normally and rolled back when it raises an error.
+ *      Inside of an open transaction, the script just joins it.
+ *
+ * Results:
+ *      Standard Tcl result; the result of the script.
+ *
+ * Side effects:
+ *      Switches autocommit of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCTransactionCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle    *handle;
+    OdbcConn       *connPtr;
+    SQLRETURN       rc;
+    int             result;
+
+    if (argc != 4) {
+        return BadArgs(interp, argv, "begin|commit|rollback dbId | dbId script");
+    }
+
+    if (STREQ(argv[2], "begin") || STREQ(argv[2], "commit")
+        || STREQ(argv[2], "rollback")) {
+        if (ODBCGetHandle(interp, argv[3], &handle) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        connPtr = handle->connection;
+        if (STREQ(argv[2], "begin")) {
+            if (connPtr->inTransaction) {
+                Tcl_AppendResult(interp, "handle \"", argv[3],
+                                 "\" is already in a transaction", NULL);
+                return TCL_ERROR;
+            }
+            rc = ODBCBeginTran(handle);
+        } else if (!connPtr->inTransaction) {
+            Tcl_AppendResult(interp, "handle \"", argv[3],
+                             "\" is not in a transaction", NULL);
+            return TCL_ERROR;
+        } else {
+            rc = ODBCEndTran(handle, STREQ(argv[2], "commit") ? SQL_COMMIT : SQL_ROLLBACK);
+        }
+        if (!RC_OK(rc)) {
+            Tcl_AppendResult(interp, handle->dsExceptionMsg.string, NULL);
+            return TCL_ERROR;
+        }
+        return TCL_OK;
+    }
+
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    connPtr = handle->connection;
+    if (connPtr->inTransaction) {
+        return Tcl_Eval(interp, argv[3]);
+    }
+    rc = ODBCBeginTran(handle);
+    if (!RC_OK(rc)) {
+        Tcl_AppendResult(interp, handle->dsExceptionMsg.string, NULL);
+        return TCL_ERROR;
+    }
+    result = Tcl_Eval(interp, argv[3]);
+
+    /*
+     * The script may have ended the transaction itself or released the
+     * handle.
+     */
+    if (handle->connection != connPtr || !connPtr->inTransaction) {
+        return result;
+    }
+    if (result == TCL_ERROR) {
+        (void) ODBCEndTran(handle, SQL_ROLLBACK);
+    } else {
+        rc = ODBCEndTran(handle, SQL_COMMIT);
+        if (!RC_OK(rc)) {
+            Tcl_ResetResult(interp);
+            Tcl_AppendResult(interp, handle->dsExceptionMsg.string, NULL);
+            result = TCL_ERROR;
+        }
+    }
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCStatsCmd --
+ *
+ *      Implements "ns_odbc stats ?-pool name? ?-handle dbId? ?-reset?".
+ *      Returns the statistics of all pools as dict keyed by pool name,
+ *      of one pool, or of a handle since it was taken from the pool
+ *      (see ODBCStatsObj for the format). Statistics of handles are
+ *      added to the pool when the handle is returned. The counters of
+ *      an environment are reported once: those of the shared one under
+ *      the key "shared" of the statistics of all pools, those of a
+ *      pool's own environment under "environment" of the pool.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      With "-reset", the returned statistics are cleared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCStatsCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    const char     *pool = NULL, *handleId = NULL;
+    bool            reset = NS_FALSE;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    Tcl_Obj        *resultObj;
+    int             argi;
+
+    for (argi = 2; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-reset")) {
+            reset = NS_TRUE;
+        } else if (STREQ(argv[argi], "-pool") && argi + 1 < argc) {
+            pool = argv[++argi];
+        } else if (STREQ(argv[argi], "-handle") && argi + 1 < argc) {
+            handleId = argv[++argi];
+        } else {
+            return BadArgs(interp, argv, "?-pool name? ?-handle dbId? ?-reset?");
+        }
+    }
+
+    if (handleId != NULL) {
+        Ns_DbHandle *handle;
+        OdbcConn    *connPtr;
+
+        if (ODBCGetHandle(interp, handleId, &handle) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        connPtr = handle->connection;
+        Tcl_SetObjResult(interp, ODBCStatsObj(&connPtr->stats));
+        if (reset) {
+            ODBCStatsReset(&connPtr->stats);
+        }
+        return TCL_OK;
+    }
+
+    resultObj = Tcl_NewDictObj();
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&poolsTable, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        OdbcPool *poolPtr = Tcl_GetHashValue(hPtr);
+        Tcl_Obj  *statsObj;
+
+        if (pool != NULL && !STREQ(pool, poolPtr->name)) {
+            continue;
+        }
+        Ns_MutexLock(&poolPtr->lock);
+        statsObj = ODBCStatsObj(&poolPtr->stats);
+        if (reset) {
+            ODBCStatsReset(&poolPtr->stats);
+        }
+        Ns_MutexUnlock(&poolPtr->lock);
+        if (poolPtr->envPtr != &sharedEnv) {
+            Tcl_DictObjPut(NULL, statsObj, Tcl_NewStringObj("environment", 11),
+                           ODBCEnvObj(poolPtr->envPtr, reset));
+        }
+
+        if (pool != NULL) {
+            Tcl_DecrRefCount(resultObj);
+            resultObj = statsObj;
+            break;
+        }
+        Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj(poolPtr->name, -1), statsObj);
+    }
+    Ns_MutexUnlock(&poolsLock);
+    if (pool != NULL && hPtr == NULL) {
+        Tcl_DecrRefCount(resultObj);
+        Tcl_AppendResult(interp, "no statistics for pool \"", pool, "\"", NULL);
+        return TCL_ERROR;
+    }
+    if (pool == NULL) {
+        Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("shared", 6),
+                       ODBCEnvObj(&sharedEnv, reset));
+    }
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCSlowQueriesCmd --
+ *
+ *      Implements "ns_odbc slowqueries ?-pool name? ?-reset?". Returns
+ *      the aggregated timings of the statements logged by the slow
+ *      query log.
+ *
+ * Results:
+ *      Standard Tcl result; a list of dicts with the keys "pool",
+ *      "fingerprint", "count", "total" and "max" (microseconds) and
+ *      "rows".
+ *
+ * Side effects:
+ *      With "-reset", the aggregated timings are cleared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCSlowQueriesCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    const char     *pool = NULL;
+    bool            reset = NS_FALSE;
+    Tcl_HashEntry  *hPtr, *qPtr;
+    Tcl_HashSearch  search, qSearch;
+    Tcl_Obj        *resultObj;
+    int             argi;
+
+    for (argi = 2; argi < argc; argi++) {
+        if (STREQ(argv[argi], "-reset")) {
+            reset = NS_TRUE;
+        } else if (STREQ(argv[argi], "-pool") && argi + 1 < argc) {
+            pool = argv[++argi];
+        } else {
+            return BadArgs(interp, argv, "?-pool name? ?-reset?");
+        }
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&poolsTable, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        OdbcPool *poolPtr = Tcl_GetHashValue(hPtr);
+
+        if (pool != NULL && !STREQ(pool, poolPtr->name)) {
+            continue;
+        }
+        Ns_MutexLock(&poolPtr->lock);
+        for (qPtr = Tcl_FirstHashEntry(&poolPtr->slowQueries, &qSearch); qPtr != NULL;
+             qPtr = Tcl_NextHashEntry(&qSearch)) {
+            OdbcSlowQuery *queryPtr = Tcl_GetHashValue(qPtr);
+            Tcl_Obj       *queryObj = Tcl_NewDictObj();
+
+            Tcl_DictObjPut(NULL, queryObj, Tcl_NewStringObj("pool", 4),
+                           Tcl_NewStringObj(poolPtr->name, -1));
+            Tcl_DictObjPut(NULL, queryObj, Tcl_NewStringObj("fingerprint", 11),
+                           Tcl_NewStringObj(Tcl_GetHashKey(&poolPtr->slowQueries, qPtr), -1));
+            Tcl_DictObjPut(NULL, queryObj, Tcl_NewStringObj("count", 5),
+                           Tcl_NewWideIntObj(queryPtr->count));
+            Tcl_DictObjPut(NULL, queryObj, Tcl_NewStringObj("total", 5),
+                           Tcl_NewWideIntObj(queryPtr->totalUs));
+            Tcl_DictObjPut(NULL, queryObj, Tcl_NewStringObj("max", 3),
+                           Tcl_NewWideIntObj(queryPtr->maxUs));
+            Tcl_DictObjPut(NULL, queryObj, Tcl_NewStringObj("rows", 4),
+                           Tcl_NewWideIntObj(queryPtr->rows));
+            Tcl_ListObjAppendElement(NULL, resultObj, queryObj);
+            if (reset) {
+                ns_free(queryPtr);
+                Tcl_DeleteHashEntry(qPtr);
+            }
+        }
+        Ns_MutexUnlock(&poolPtr->lock);
+    }
+    Ns_MutexUnlock(&poolsLock);
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCServerInit -
+ *
+ *	Initialize the server when nsdb is ready.
+ *
+ * Results:
+ *	NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *	Adds ns_odbc command.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Ns_ReturnCode
+AddCmds(Tcl_Interp *interp, const void *UNUSED(arg))
+{
+    Tcl_CreateCommand(interp, "ns_odbc", ODBCCmd, NULL, NULL);
     Tcl_CreateCommand(interp, "ns_odbc_bind", ODBCBindCmd, NULL, NULL);
     return NS_OK;
 }
 
-Ns_ReturnCode
-ODBCServerInit(const char *server, const char *UNUSED(module), const char *UNUSED(driver))
-{
-    return Ns_TclRegisterTrace(server, AddCmds, NULL, NS_TCL_TRACE_CREATE);
+Ns_ReturnCode
+ODBCServerInit(const char *server, const char *UNUSED(module), const char *driver)
+{
+    const char *pool;
+
+    /*
+     * Set up the pools of the server using this driver, and their
+     * environments, before any handle is opened.
+     */
+    pool = Ns_DbPoolList(server);
+    while (pool != NULL && *pool != '\0') {
+        const char *path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", pool, NULL);
+        const char *poolDriver = Ns_ConfigGetValue(path, "driver");
+
+        if (poolDriver != NULL && STREQ(poolDriver, driver)) {
+            (void) ODBCGetPool(pool);
+        }
+        pool += strlen(pool) + 1u;
+    }
+    return Ns_TclRegisterTrace(server, AddCmds, NULL, NS_TCL_TRACE_CREATE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCShutdown -
+ *
+ *	Callback to clean up driver on server shutdown. When called
+ *	without a timeout, the async worker threads and the watchdog
+ *	thread are told to exit. When called with the timeout, the
+ *	worker threads are joined, after finishing their current jobs,
+ *	and the ODBC environments are freed.
+ *
+ * Results:
+ *	Resources are freed.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCShutdown(const Ns_Time *timeoutPtr, void *UNUSED(arg))
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    RETCODE        rc;
+    Ns_LogSeverity severity;
+    Ns_ReturnCode  status = NS_OK;
+    int            i, numStarted;
+
+    if (timeoutPtr == NULL) {
+        Ns_MutexLock(&async.lock);
+        async.shutdown = NS_TRUE;
+        Ns_CondBroadcast(&async.queueCond);
+        Ns_MutexUnlock(&async.lock);
+
+        Ns_MutexLock(&watchdog.lock);
+        watchdog.shutdown = NS_TRUE;
+        Ns_CondSignal(&watchdog.cond);
+        Ns_MutexUnlock(&watchdog.lock);
+        return;
+    }
+
+    Ns_MutexLock(&async.lock);
+    while (async.numThreads > 0 && status == NS_OK) {
+        status = Ns_CondTimedWait(&async.doneCond, &async.lock, timeoutPtr);
+    }
+    numStarted = async.numStarted;
+    Ns_MutexUnlock(&async.lock);
+    if (status != NS_OK) {
+        Ns_Log(Warning, "nsodbc: timeout waiting for async worker threads");
+        return;
+    }
+    for (i = 0; i < numStarted; i++) {
+        Ns_ThreadJoin(&async.threads[i], NULL);
+    }
+
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&poolsTable, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        const OdbcPool *poolPtr = Tcl_GetHashValue(hPtr);
+
+        if (poolPtr->envPtr != &sharedEnv) {
+            (void) SQLFreeEnv(poolPtr->envPtr->henv);
+        }
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    rc = SQLFreeEnv(sharedEnv.henv);
+    if (rc == SQL_SUCCESS_WITH_INFO) {
+        severity = Warning;
+    } else if (rc == SQL_ERROR) {
+        severity = Error;
+    } else {
+        return;
+    }
+    Ns_Log(severity, "odbc shutdown retorts problem");
+}
+
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCName -
+ *
+ *	Return the ODBC driver name.
+ *
+ * Results:
+ *	Pointer to static string name.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+ODBCName(void)
+{
+    return odbcName;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCGetPool -
+ *
+ *	Return the driver settings of the named pool, reading them from
+ *	the pool's configuration section on first use.
+ *
+ * Results:
+ *	Pointer to OdbcPool, valid for the lifetime of the server.
+ *
+ * Side effects:
+ *	May create a new pool entry.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static OdbcPool *
+ODBCGetPool(const char *poolname)
+{
+    Tcl_HashEntry  *hPtr;
+    OdbcPool       *poolPtr;
+    const char     *path, *initSql;
+    int             isNew;
+
+    Ns_MutexLock(&poolsLock);
+    hPtr = Tcl_CreateHashEntry(&poolsTable, poolname, &isNew);
+    if (isNew != 0) {
+        path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", poolname, NULL);
+        poolPtr = ns_calloc(1u, sizeof(OdbcPool));
+        poolPtr->name = Tcl_GetHashKey(&poolsTable, hPtr);
+        poolPtr->rowsetSize = (SQLULEN)Ns_ConfigIntRange(path, "rowsetsize",
+                                                         1, 1, 65535);
+        poolPtr->maxBindSize = Ns_ConfigIntRange(path, "maxbindsize",
+                                                 8192, 64, INT_MAX);
+        poolPtr->nativeBind = Ns_ConfigBool(path, "nativebind", NS_FALSE);
+        poolPtr->stmtCacheSize = Ns_ConfigIntRange(path, "stmtcachesize",
+                                                   0, 0, 10000);
+        poolPtr->batchSize = Ns_ConfigIntRange(path, "batchsize",
+                                               1000, 1, 100000);
+        poolPtr->queryTimeout = Ns_ConfigIntRange(path, "querytimeout",
+                                                  0, 0, INT_MAX);
+        (void) Ns_ConfigTimeUnitRange(path, "slowquerytime", "0s", 0, 0,
+                                      INT_MAX, 0, &poolPtr->slowQueryTime);
+        poolPtr->slowQuerySample = Ns_ConfigIntRange(path, "slowquerysample",
+                                                     0, 0, INT_MAX);
+        poolPtr->envPtr = &sharedEnv;
+        if (Ns_ConfigBool(path, "environment", NS_FALSE)) {
+            const char *match = Ns_ConfigString(path, "cpmatch", "strict");
+
+            poolPtr->envPtr = ODBCNewEnv(poolname, STREQ(match, "relaxed")
+                                         ? SQL_CP_RELAXED_MATCH : SQL_CP_STRICT_MATCH);
+            if (poolPtr->envPtr == NULL) {
+                Ns_Log(Error, "nsodbc[%s]: could not allocate environment, using shared",
+                       poolname);
+                poolPtr->envPtr = &sharedEnv;
+            }
+        }
+        poolPtr->warmup = Ns_ConfigIntRange(path, "warmup", 0, 0, INT_MAX);
+        poolPtr->connections = Ns_ConfigIntRange(path, "connections", 2, 0, INT_MAX);
+        if (poolPtr->warmup > poolPtr->connections) {
+            poolPtr->warmup = poolPtr->connections;
+        }
+        initSql = Ns_ConfigGetValue(path, "initsql");
+        if (initSql != NULL
+            && Tcl_SplitList(NULL, initSql, &poolPtr->numInitSql,
+                             &poolPtr->initSql) != TCL_OK) {
+            Ns_Log(Error, "nsodbc[%s]: invalid initsql list", poolname);
+            poolPtr->numInitSql = 0;
+        }
+        Ns_MutexSetName2(&poolPtr->lock, "nsodbc:pool", poolname);
+        ODBCStatsInit(&poolPtr->stats);
+        Tcl_InitHashTable(&poolPtr->slowQueries, TCL_STRING_KEYS);
+        Tcl_SetHashValue(hPtr, poolPtr);
+    } else {
+        poolPtr = Tcl_GetHashValue(hPtr);
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    return poolPtr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCNewEnv -
+ *
+ *	Allocate an ODBC environment for a pool, with ODBC 3 behavior
+ *	and the given match criteria for pooled connections.
+ *
+ * Results:
+ *	Environment, or NULL on error.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static OdbcEnv *
+ODBCNewEnv(const char *name, SQLULEN cpMatch)
+{
+    OdbcEnv   *envPtr;
+    SQLHENV    henv;
+    SQLRETURN  rc;
+
+    rc = SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &henv);
+    if (!RC_OK(rc)) {
+        return NULL;
+    }
+    rc = SQLSetEnvAttr(henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER)SQL_OV_ODBC3, 0);
+    if (!RC_OK(rc)) {
+        (void) SQLFreeHandle(SQL_HANDLE_ENV, henv);
+        return NULL;
+    }
+    rc = SQLSetEnvAttr(henv, SQL_ATTR_CP_MATCH, (SQLPOINTER)cpMatch, 0);
+    if (!RC_OK(rc)) {
+        Ns_Log(Warning, "nsodbc[%s]: could not set cpmatch", name);
+    }
+    envPtr = ns_calloc(1u, sizeof(OdbcEnv));
+    envPtr->henv = henv;
+
+    return envPtr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCEnvEnter, ODBCEnvLeave -
+ *
+ *	Account a call going through the environment in the driver
+ *	manager: ODBCEnvEnter before the call, ODBCEnvLeave with its
+ *	start time after it. The counters are updated atomically, so
+ *	that measuring the contention does not add to it.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Updates the counters of the environment.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCEnvEnter(OdbcEnv *envPtr)
+{
+    Tcl_WideInt active = ODBCAtomicAdd(&envPtr->active, 1);
+
+    if (active > 1) {
+        (void) ODBCAtomicAdd(&envPtr->contended, 1);
+    }
+    ODBCAtomicMax(&envPtr->maxActive, active);
+}
+
+static void
+ODBCEnvLeave(OdbcEnv *envPtr, const Ns_Time *startPtr)
+{
+    Ns_Time     now, diff;
+    Tcl_WideInt us;
+
+    Ns_GetTime(&now);
+    (void) Ns_DiffTime(&now, startPtr, &diff);
+    us = (Tcl_WideInt)diff.sec * 1000000 + diff.usec;
+
+    (void) ODBCAtomicAdd(&envPtr->active, -1);
+    (void) ODBCAtomicAdd(&envPtr->calls, 1);
+    (void) ODBCAtomicAdd(&envPtr->totalUs, us);
+    ODBCAtomicMax(&envPtr->maxUs, us);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAtomicAdd, ODBCAtomicMax, ODBCAtomicGet -
+ *
+ *	Update or read a counter shared between threads: add to it,
+ *	raise it to a maximum, or read and optionally clear it. With
+ *	compilers lacking atomic builtins, a global mutex is used.
+ *
+ * Results:
+ *	ODBCAtomicAdd: the new value. ODBCAtomicGet: the value before
+ *	clearing.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#if defined(__GNUC__)
+
+static Tcl_WideInt
+ODBCAtomicAdd(Tcl_WideInt *counterPtr, Tcl_WideInt n)
+{
+    return __atomic_add_fetch(counterPtr, n, __ATOMIC_RELAXED);
+}
+
+static void
+ODBCAtomicMax(Tcl_WideInt *counterPtr, Tcl_WideInt value)
+{
+    Tcl_WideInt old = __atomic_load_n(counterPtr, __ATOMIC_RELAXED);
+
+    while (value > old
+           && !__atomic_compare_exchange_n(counterPtr, &old, value, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+static Tcl_WideInt
+ODBCAtomicGet(Tcl_WideInt *counterPtr, bool reset)
+{
+    return reset ? __atomic_exchange_n(counterPtr, 0, __ATOMIC_RELAXED)
+        : __atomic_load_n(counterPtr, __ATOMIC_RELAXED);
+}
+
+#else
+
+static Ns_Mutex atomicLock;
+
+static Tcl_WideInt
+ODBCAtomicAdd(Tcl_WideInt *counterPtr, Tcl_WideInt n)
+{
+    Tcl_WideInt value;
+
+    Ns_MutexLock(&atomicLock);
+    value = (*counterPtr += n);
+    Ns_MutexUnlock(&atomicLock);
+
+    return value;
+}
+
+static void
+ODBCAtomicMax(Tcl_WideInt *counterPtr, Tcl_WideInt value)
+{
+    Ns_MutexLock(&atomicLock);
+    if (value > *counterPtr) {
+        *counterPtr = value;
+    }
+    Ns_MutexUnlock(&atomicLock);
+}
+
+static Tcl_WideInt
+ODBCAtomicGet(Tcl_WideInt *counterPtr, bool reset)
+{
+    Tcl_WideInt value;
+
+    Ns_MutexLock(&atomicLock);
+    value = *counterPtr;
+    if (reset) {
+        *counterPtr = 0;
+    }
+    Ns_MutexUnlock(&atomicLock);
+
+    return value;
+}
+
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAllocStmt, ODBCDropHstmt -
+ *
+ *	Allocate or drop an ODBC statement of the handle, accounted to
+ *	its environment.
+ *
+ * Results:
+ *	ODBC return code.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCAllocStmt(const OdbcConn *connPtr, SQLHSTMT *hstmtPtr)
+{
+    OdbcEnv   *envPtr = connPtr->poolPtr->envPtr;
+    SQLRETURN  rc;
+    Ns_Time    start;
+
+    ODBCEnvEnter(envPtr);
+    Ns_GetTime(&start);
+    rc = SQLAllocStmt(connPtr->hdbc, hstmtPtr);
+    ODBCEnvLeave(envPtr, &start);
+
+    return rc;
+}
+
+static SQLRETURN
+ODBCDropHstmt(const OdbcConn *connPtr, SQLHSTMT hstmt)
+{
+    OdbcEnv   *envPtr = connPtr->poolPtr->envPtr;
+    SQLRETURN  rc;
+    Ns_Time    start;
+
+    ODBCEnvEnter(envPtr);
+    Ns_GetTime(&start);
+    rc = SQLFreeStmt(hstmt, SQL_DROP);
+    ODBCEnvLeave(envPtr, &start);
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCEnvObj -
+ *
+ *	Report the counters of an environment for "ns_odbc stats".
+ *
+ * Results:
+ *	Dict with the keys "calls", "contended", "maxconcurrent",
+ *	"total" and "max" (microseconds).
+ *
+ * Side effects:
+ *	With "reset", the counters are cleared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ODBCEnvObj(OdbcEnv *envPtr, bool reset)
+{
+    Tcl_Obj *envObj = Tcl_NewDictObj();
+
+    Tcl_DictObjPut(NULL, envObj, Tcl_NewStringObj("calls", 5),
+                   Tcl_NewWideIntObj(ODBCAtomicGet(&envPtr->calls, reset)));
+    Tcl_DictObjPut(NULL, envObj, Tcl_NewStringObj("contended", 9),
+                   Tcl_NewWideIntObj(ODBCAtomicGet(&envPtr->contended, reset)));
+    Tcl_DictObjPut(NULL, envObj, Tcl_NewStringObj("maxconcurrent", 13),
+                   Tcl_NewWideIntObj(ODBCAtomicGet(&envPtr->maxActive, reset)));
+    Tcl_DictObjPut(NULL, envObj, Tcl_NewStringObj("total", 5),
+                   Tcl_NewWideIntObj(ODBCAtomicGet(&envPtr->totalUs, reset)));
+    Tcl_DictObjPut(NULL, envObj, Tcl_NewStringObj("max", 3),
+                   Tcl_NewWideIntObj(ODBCAtomicGet(&envPtr->maxUs, reset)));
+    if (reset) {
+        ODBCAtomicMax(&envPtr->maxActive, ODBCAtomicGet(&envPtr->active, NS_FALSE));
+    }
+
+    return envObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCOpenDb -
+ *
+ *	Open an ODBC datasource and run the "initsql" statements of the
+ *	pool on the new connection.
+ *
+ * Results:
+ *	NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *	Performs SQLAllocConnect and SQLConnect or SQLDriverConnect.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCOpenDb(Ns_DbHandle *handle)
+{
+    OdbcConn       *connPtr;
+    OdbcEnv        *envPtr;
+    SQLHDBC         hdbc;
+    RETCODE         rc;
+    Ns_Time         start;
+
+    assert(handle != NULL);
+    assert(handle->datasource != NULL);
+
+    handle->connected = NS_FALSE;
+    handle->connection = NULL;
+    handle->statement = NULL;
+
+    connPtr = ns_calloc(1u, sizeof(OdbcConn));
+    connPtr->poolPtr = ODBCGetPool(handle->poolname);
+    connPtr->handle = handle;
+    connPtr->queryTimeout = -1;
+    ODBCStatsInit(&connPtr->stats);
+    Ns_DStringInit(&connPtr->dsSql);
+    Ns_DStringInit(&connPtr->dsValue);
+    Ns_DStringInit(&connPtr->dsNames);
+    Ns_DStringInit(&connPtr->dsKey);
+    Tcl_InitHashTable(&connPtr->stmts, TCL_STRING_KEYS);
+    handle->connection = connPtr;
+
+    envPtr = connPtr->poolPtr->envPtr;
+    ODBCEnvEnter(envPtr);
+    Ns_GetTime(&start);
+    rc = SQLAllocConnect(envPtr->henv, &hdbc);
+    ODBCEnvLeave(envPtr, &start);
+    connPtr->hdbc = hdbc;
+    ODBCLog(rc, handle);
+    if (!RC_OK(rc)) {
+        handle->connection = NULL;
+        SQLFreeConnect(hdbc);
+        ODBCStatsMerge(connPtr);
+        Tcl_DeleteHashTable(&connPtr->stats.errors);
+        ns_free(connPtr);
+        return NS_ERROR;
+    }
+    ODBCEnvEnter(envPtr);
+    Ns_GetTime(&start);
+    rc = ODBCConnect(handle, hdbc);
+    ODBCEnvLeave(envPtr, &start);
+    ODBCLog(rc, handle);
+    if (!SQL_SUCCEEDED(rc)) {
+        handle->connection = NULL;
+        SQLFreeConnect(hdbc);
+        ODBCStatsMerge(connPtr);
+        Tcl_DeleteHashTable(&connPtr->stats.errors);
+        ns_free(connPtr);
+        return NS_ERROR;
+    }
+    handle->connected = NS_TRUE;
+    if (!ODBCInitSession(handle)) {
+        (void) ODBCCloseDb(handle);
+        return NS_ERROR;
+    }
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCConnect -
+ *
+ *	Connect to the datasource of the handle: a datasource containing
+ *	"=" is a connection string for SQLDriverConnect, to which the
+ *	user and password are added unless empty, quoted in braces so
+ *	that they may contain ";" and "="; otherwise, it is a DSN for
+ *	SQLConnect.
+ *
+ * Results:
+ *	ODBC return code.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCConnect(Ns_DbHandle *handle, SQLHDBC hdbc)
+{
+    Ns_DString  ds;
+    SQLRETURN   rc;
+
+    if (strchr(handle->datasource, '=') == NULL) {
+        Ns_Log(Notice, "%s[%s]: attemping to open '%s'",
+               handle->driver, handle->poolname, handle->datasource);
+        return SQLConnect(hdbc,
+                          (SQLCHAR *)handle->datasource, SQL_NTS,
+                          (SQLCHAR *)handle->user, SQL_NTS,
+                          (SQLCHAR *)handle->password, SQL_NTS);
+    }
+
+    /*
+     * The connection string may contain credentials, don't log it.
+     */
+    Ns_Log(Notice, "%s[%s]: attemping to open connection string",
+           handle->driver, handle->poolname);
+    Ns_DStringInit(&ds);
+    Ns_DStringAppend(&ds, handle->datasource);
+    if (handle->user != NULL && *handle->user != '\0') {
+        ODBCAppendAttribute(&ds, "UID", handle->user);
+    }
+    if (handle->password != NULL && *handle->password != '\0') {
+        ODBCAppendAttribute(&ds, "PWD", handle->password);
+    }
+    rc = SQLDriverConnect(hdbc, NULL, (SQLCHAR *)ds.string, SQL_NTS,
+                          NULL, 0, NULL, SQL_DRIVER_NOPROMPT);
+    Ns_DStringFree(&ds);
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAppendAttribute -
+ *
+ *	Append ";key={value}" to a connection string, doubling the
+ *	closing braces of the value.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Appends to the Ns_DString.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCAppendAttribute(Ns_DString *dsPtr, const char *key, const char *value)
+{
+    const char *brace;
+
+    Ns_DStringVarAppend(dsPtr, ";", key, "={", NULL);
+    while ((brace = strchr(value, '}')) != NULL) {
+        Ns_DStringNAppend(dsPtr, value, (int)(brace - value) + 1);
+        Ns_DStringNAppend(dsPtr, "}", 1);
+        value = brace + 1;
+    }
+    Ns_DStringVarAppend(dsPtr, value, "}", NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCConnectionDead -
+ *
+ *	Check with SQL_ATTR_CONNECTION_DEAD whether the driver knows the
+ *	connection to be lost. This does not involve a round trip to
+ *	the database, so it does not detect all failures.
+ *
+ * Results:
+ *	NS_TRUE when the connection is dead, NS_FALSE when it is alive
+ *	or the driver does not support the attribute.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCConnectionDead(const Ns_DbHandle *handle)
+{
+    const OdbcConn *connPtr = handle->connection;
+    SQLUINTEGER     dead = SQL_CD_FALSE;
+    SQLRETURN       rc;
+
+    rc = SQLGetConnectAttr(connPtr->hdbc, SQL_ATTR_CONNECTION_DEAD, &dead, 0, NULL);
+    return (RC_OK(rc) && dead == SQL_CD_TRUE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCLinkFailure -
+ *
+ *	Check whether the last error of the handle was caused by a
+ *	broken connection: SQLSTATE 08S01 (communication link failure)
+ *	or 08003 (connection not open), or the connection is dead.
+ *
+ * Results:
+ *	NS_TRUE or NS_FALSE.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCLinkFailure(const Ns_DbHandle *handle)
+{
+    return (STREQ(handle->cExceptionCode, "08S01")
+            || STREQ(handle->cExceptionCode, "08003")
+            || ODBCConnectionDead(handle));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCIsRead -
+ *
+ *	Check whether an SQL statement is a plain query, which can be
+ *	retried safely: a single SELECT without INTO. Statements starting
+ *	with WITH are not retried, since their common table expressions
+ *	may modify data.
+ *
+ * Results:
+ *	NS_TRUE or NS_FALSE.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCIsRead(const char *sql)
+{
+    const char *p;
+
+    while (CHARTYPE(space, *sql) != 0 || *sql == '(') {
+        sql++;
+    }
+    if (Tcl_UtfNcasecmp(sql, "select", 6u) != 0 || BINDCHAR(sql[6])) {
+        return NS_FALSE;
+    }
+    for (p = sql + 6; *p != '\0'; p++) {
+        if (*p == '\'' || *p == '"') {
+            const char *q = strchr(p + 1, *p);
+
+            if (q == NULL) {
+                break;
+            }
+            p = q;
+        } else if (*p == ';') {
+            return NS_FALSE;
+        } else if (!BINDCHAR(p[-1]) && Tcl_UtfNcasecmp(p, "into", 4u) == 0
+                   && !BINDCHAR(p[4])) {
+            return NS_FALSE;
+        }
+    }
+    return NS_TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCReconnect -
+ *
+ *	Replace the connection of the handle after it was lost: drop
+ *	its statements, disconnect and connect again, and run the
+ *	"initsql" statements of the pool.
+ *
+ * Results:
+ *	NS_TRUE when connected again.
+ *
+ * Side effects:
+ *	Counts the reconnect in the statistics of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCReconnect(Ns_DbHandle *handle)
+{
+    OdbcConn  *connPtr = handle->connection;
+    OdbcEnv   *envPtr = connPtr->poolPtr->envPtr;
+    SQLRETURN  rc;
+    Ns_Time    start;
+    bool       ok;
+
+    if (handle->statement != NULL) {
+        (void) ODBCFreeStmt(handle);
+    }
+    while (connPtr->lruHead != NULL) {
+        ODBCDropStmt(connPtr, connPtr->lruHead);
+    }
+    ODBCEnvEnter(envPtr);
+    Ns_GetTime(&start);
+    (void) SQLDisconnect(connPtr->hdbc);
+    rc = ODBCConnect(handle, connPtr->hdbc);
+    ODBCEnvLeave(envPtr, &start);
+    ODBCLog(rc, handle);
+    connPtr->reconnecting = NS_TRUE;
+    ok = (SQL_SUCCEEDED(rc) && ODBCInitSession(handle));
+    connPtr->reconnecting = NS_FALSE;
+    if (!ok) {
+        Ns_Log(Error, "%s[%s]: reconnect failed", handle->driver, handle->poolname);
+        connPtr->stats.failedReconnects++;
+        return NS_FALSE;
+    }
+    connPtr->stats.reconnects++;
+    return NS_TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAliveCmd --
+ *
+ *      Implements "ns_odbc alive dbId". Checks the connection of the
+ *      handle without a round trip to the database.
+ *
+ * Results:
+ *      Standard Tcl result; 0 when the driver knows the connection to
+ *      be dead, 1 otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCAliveCmd(Tcl_Interp *interp, int argc, const char *argv[])
+{
+    Ns_DbHandle *handle;
+
+    if (argc != 3) {
+        return BadArgs(interp, argv, "dbId");
+    }
+    if (ODBCGetHandle(interp, argv[2], &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(!ODBCConnectionDead(handle)));
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCInitSession -
+ *
+ *	Run the "initsql" statements of the pool on a new connection.
+ *
+ * Results:
+ *	NS_TRUE on success, NS_FALSE when a statement failed.
+ *
+ * Side effects:
+ *	Depends on the statements.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCInitSession(Ns_DbHandle *handle)
+{
+    const OdbcPool *poolPtr = ((OdbcConn *) handle->connection)->poolPtr;
+    int             i;
+
+    for (i = 0; i < poolPtr->numInitSql; i++) {
+        int status = ODBCExec(handle, poolPtr->initSql[i]);
+
+        if (status == NS_ROWS) {
+            (void) ODBCFreeStmt(handle);
+        } else if (status == NS_ERROR) {
+            Ns_Log(Error, "%s[%s]: initsql failed: %s",
+                   handle->driver, handle->poolname, poolPtr->initSql[i]);
+            return NS_FALSE;
+        }
+    }
+    return NS_TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCWarmup -
+ *
+ *	Startup callback: open "warmup" handles of every pool in
+ *	parallel, one thread per handle, before the server accepts
+ *	requests.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Handles are connected and returned to their pools.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCWarmup(void *UNUSED(arg))
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    Ns_Thread      *threads;
+    Ns_Time         start, end, diff;
+    int             i, n = 0, numThreads = 0;
+
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&poolsTable, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        numThreads += ((const OdbcPool *)Tcl_GetHashValue(hPtr))->warmup;
+    }
+    if (numThreads == 0) {
+        Ns_MutexUnlock(&poolsLock);
+        return;
+    }
+    Ns_GetTime(&start);
+    warmup.numThreads = numThreads;
+    threads = ns_calloc((size_t)numThreads, sizeof(Ns_Thread));
+    for (hPtr = Tcl_FirstHashEntry(&poolsTable, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        const OdbcPool *poolPtr = Tcl_GetHashValue(hPtr);
+
+        for (i = 0; i < poolPtr->warmup; i++) {
+            Ns_ThreadCreate(ODBCWarmupThread, (void *)poolPtr->name, 0, &threads[n++]);
+        }
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    for (i = 0; i < n; i++) {
+        Ns_ThreadJoin(&threads[i], NULL);
+    }
+    ns_free(threads);
+    Ns_GetTime(&end);
+    (void) Ns_DiffTime(&end, &start, &diff);
+    Ns_Log(Notice, "nsodbc: warm-up opened %d of %d handles in %.6f s",
+           warmup.numOpened, numThreads, (double)diff.sec + (double)diff.usec / 1e6);
+}
+
+static void
+ODBCWarmupThread(void *arg)
+{
+    const char  *pool = arg;
+    Ns_DbHandle *handle;
+
+    Ns_ThreadSetName("-odbc-warmup-");
+    handle = Ns_DbPoolGetHandle(pool);
+
+    /*
+     * Hold the handle until all threads got theirs, otherwise the
+     * same one might be handed out again.
+     */
+    Ns_MutexLock(&warmup.lock);
+    if (handle != NULL) {
+        warmup.numOpened++;
+    }
+    if (++warmup.numDone == warmup.numThreads) {
+        Ns_CondBroadcast(&warmup.cond);
+    }
+    while (warmup.numDone < warmup.numThreads) {
+        Ns_CondWait(&warmup.cond, &warmup.lock);
+    }
+    Ns_MutexUnlock(&warmup.lock);
+
+    if (handle != NULL) {
+        Ns_DbPoolPutHandle(handle);
+    } else {
+        Ns_Log(Warning, "nsodbc[%s]: warm-up could not open handle", pool);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCCloseDb -
+ *
+ *	Close an ODBC datasource.
+ *
+ * Results:
+ *	NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *	Performs both SQLDisconnect and SQLFreeConnect.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Ns_ReturnCode
+ODBCCloseDb(Ns_DbHandle *handle)
+{
+    RETCODE         rc;
+    SQLHDBC         hdbc;
+    OdbcConn       *connPtr;
+    OdbcEnv        *envPtr;
+    Ns_Time         start;
+
+    connPtr = handle->connection;
+    hdbc = connPtr->hdbc;
+    envPtr = connPtr->poolPtr->envPtr;
+    if (connPtr->inTransaction) {
+        (void) SQLEndTran(SQL_HANDLE_DBC, hdbc, SQL_ROLLBACK);
+    }
+    handle->connection = NULL;
+    handle->connected = NS_FALSE;
+    ODBCUnwatchStmt(connPtr);
+    ODBCStatsMerge(connPtr);
+    Tcl_DeleteHashTable(&connPtr->stats.errors);
+    while (connPtr->lruHead != NULL) {
+        ODBCDropStmt(connPtr, connPtr->lruHead);
+    }
+    Tcl_DeleteHashTable(&connPtr->stmts);
+    ODBCResetColumns(connPtr);
+    ns_free(connPtr->columns);
+    ns_free(connPtr->arena);
+    ns_free(connPtr->params);
+    Ns_DStringFree(&connPtr->dsValue);
+    Ns_DStringFree(&connPtr->dsNames);
+    Ns_DStringFree(&connPtr->dsKey);
+    Ns_DStringFree(&connPtr->dsSql);
+    ns_free(connPtr);
+
+    ODBCEnvEnter(envPtr);
+    Ns_GetTime(&start);
+    rc = SQLDisconnect(hdbc);
+    if (RC_OK(rc)) {
+        rc = SQLFreeConnect(hdbc);
+    }
+    ODBCEnvLeave(envPtr, &start);
+    if (!RC_OK(rc)) {
+        return NS_ERROR;
+    }
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCExec -
+ *
+ *	Send an SQL statement. A dead connection is replaced first, and
+ *	reads failing because of a communication link failure are
+ *	retried once on a new connection, unless in a transaction.
+ *
+ * Results:
+ *	NS_DML, NS_ROWS, or NS_ERROR.
+ *
+ * Side effects:
+ *	Database may be modified or rows may be waiting.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCExec(Ns_DbHandle *handle, const char *sql)
+{
+    OdbcConn       *connPtr = handle->connection;
+    RETCODE         rc;
+    int             status = NS_OK, numParams = connPtr->numParams;
+    short           numcols;
+
+    /*
+     * Replace a connection known to be dead before sending anything.
+     * Statements of "initsql" run while reconnecting are not retried.
+     */
+    if (!connPtr->inTransaction && !connPtr->reconnecting && ODBCConnectionDead(handle)) {
+        Ns_Log(Warning, "%s[%s]: connection is dead, reconnecting",
+               handle->driver, handle->poolname);
+        connPtr->numParams = 0;
+        (void) ODBCReconnect(handle);
+        connPtr->numParams = numParams;
+    }
+
+    rc = ODBCExecute(handle, sql);
+    if ((handle->statement == NULL || (!RC_OK(rc) && rc != SQL_NO_DATA))
+        && !connPtr->inTransaction && !connPtr->reconnecting
+        && ODBCLinkFailure(handle) && ODBCIsRead(sql)) {
+        /*
+         * Reads are idempotent, retry them once on a new connection.
+         */
+        Ns_Log(Warning, "%s[%s]: communication failure (%s), reconnecting",
+               handle->driver, handle->poolname, handle->cExceptionCode);
+        if (ODBCReconnect(handle)) {
+            connPtr->stats.retries++;
+            connPtr->numParams = numParams;
+            Ns_DStringFree(&handle->dsExceptionMsg);
+            handle->cExceptionCode[0] = '\0';
+            rc = ODBCExecute(handle, sql);
+        }
+    }
+    if (handle->statement == NULL) {
+        return NS_ERROR;
+    }
+    if (rc == SQL_NO_DATA) {
+        /*
+         * Searched UPDATE or DELETE affecting no rows (ODBC 3).
+         */
+        rc = SQL_SUCCESS;
+    }
+
+    /*
+     * Determine if rows are available.
+     */
+
+    if (RC_OK(rc)) {
+        rc = SQLNumResultCols((HSTMT) handle->statement, &numcols);
+        ODBCLog(rc, handle);
+        if (RC_OK(rc)) {
+            if (numcols != 0) {
+                handle->fetchingRows = 1;
+                status = NS_ROWS;
+            } else {
+                status = NS_DML;
+            }
+        }
+    }
+
+    /*
+     * Free the statement unless rows are waiting.
+     */
+
+    if (!RC_OK(rc)) {
+        status = NS_ERROR;
+    }
+    if (status != NS_ROWS && ODBCFreeStmt(handle) != NS_OK) {
+        status = NS_ERROR;
+    }
+
+    /*
+     * Writes on a handle of a route's write pool open the sticky
+     * window of the route, as writes through the route do.
+     */
+    if (numRoutes > 0 && status != NS_ERROR
+        && (status == NS_DML || !ODBCIsRead(sql))) {
+        ODBCMarkWrite(handle->poolname);
+    }
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCExecute -
+ *
+ *	Allocate or prepare a statement for the SQL and execute it.
+ *
+ * Results:
+ *	ODBC return code. The statement is left in handle->statement,
+ *	also when the execution failed; handle->statement is NULL only
+ *	when no statement could be allocated.
+ *
+ * Side effects:
+ *	Frees the previous statement of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static RETCODE
+ODBCExecute(Ns_DbHandle *handle, const char *sql)
+{
+    HSTMT           hstmt;
+    RETCODE         rc;
+    bool            prepared;
+    Ns_Time         start;
+    OdbcConn       *connPtr = handle->connection;
+
+    if (handle->statement != NULL) {
+        (void) ODBCFreeStmt(handle);
+    }
+    connPtr->numCols = 0;
+
+    connPtr->timing = (connPtr->poolPtr->slowQueryTime.sec > 0
+                       || connPtr->poolPtr->slowQueryTime.usec > 0
+                       || connPtr->poolPtr->slowQuerySample > 0);
+    if (connPtr->timing) {
+        Ns_GetTime(&connPtr->stmtStart);
+        connPtr->execUs = connPtr->fetchUs = connPtr->stmtRows = 0;
+        Ns_DStringSetLength(&connPtr->dsSql, 0);
+        Ns_DStringAppend(&connPtr->dsSql, sql);
+    }
+
+    /*
+     * Get a statement: a prepared one from the statement cache of the
+     * handle, or a new one.
+     */
+
+    prepared = (connPtr->poolPtr->stmtCacheSize > 0 || connPtr->numParams > 0);
+    Ns_GetTime(&start);
+    if (prepared) {
+        rc = ODBCPrepareStmt(handle, sql);
+    } else {
+        rc = ODBCAllocStmt(connPtr, &hstmt);
+        ODBCLog(rc, handle);
+        if (RC_OK(rc)) {
+            handle->statement = hstmt;
+        }
+    }
+    ODBCPhaseDone(connPtr, ODBC_PHASE_ALLOCATE, &start);
+    if (handle->statement == NULL) {
+        connPtr->numParams = 0;
+        return rc;
+    }
+
+    /*
+     * Send the SQL.
+     */
+
+    hstmt = (HSTMT) handle->statement;
+    if (RC_OK(rc)) {
+        ODBCWatchStmt(handle);
+        Ns_GetTime(&start);
+        if (prepared) {
+            if (connPtr->numParams > 0) {
+                rc = ODBCBindParams(handle);
+            }
+            if (RC_OK(rc)) {
+                ODBCWatchCall(connPtr);
+                rc = SQLExecute(hstmt);
+                ODBCUnwatchStmt(connPtr);
+            }
+        } else {
+            ODBCWatchCall(connPtr);
+            rc = SQLExecDirect(hstmt, (SQLCHAR *)sql, SQL_NTS);
+            ODBCUnwatchStmt(connPtr);
+        }
+        ODBCPhaseDone(connPtr, ODBC_PHASE_EXECUTE, &start);
+        ODBCLog(rc, handle);
+    }
+    connPtr->numParams = 0;
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCQueryTimeout -
+ *
+ *	Get the query timeout of the handle: the value set with "ns_odbc
+ *	timeout", or the default of the pool.
+ *
+ * Results:
+ *	Timeout in seconds, 0 for none.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ODBCQueryTimeout(const OdbcConn *connPtr)
+{
+    return (connPtr->queryTimeout >= 0) ? connPtr->queryTimeout
+        : connPtr->poolPtr->queryTimeout;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCWatchStmt -
+ *
+ *	Set the query timeout of the current statement before it is
+ *	executed. The calls of the statement which wait for the database
+ *	(SQLExecute, SQLExecDirect, SQLFetch, SQLMoreResults) are then
+ *	bracketed by ODBCWatchCall and ODBCUnwatchStmt.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCWatchStmt(Ns_DbHandle *handle)
+{
+    OdbcConn *connPtr = handle->connection;
+    int       timeout = ODBCQueryTimeout(connPtr);
+
+    /*
+     * Cached statements keep the attribute, so reset it when needed.
+     */
+    if (timeout > 0 || connPtr->stmtPtr != NULL) {
+        (void) SQLSetStmtAttr((SQLHSTMT) handle->statement, SQL_ATTR_QUERY_TIMEOUT,
+                              (SQLPOINTER)(SQLULEN)timeout, 0);
+    }
+    connPtr->watchTimeout = timeout;
+    connPtr->watchStmt = (SQLHSTMT) handle->statement;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCWatchCall, ODBCUnwatchStmt -
+ *
+ *	Register a call of the current statement with the watchdog
+ *	before it is made, and remove it when it returns. The watchdog
+ *	cancels the call when the driver does not honor the query
+ *	timeout, a few seconds after the driver should have given up
+ *	itself. Idle open cursors are not watched, however long the
+ *	rows are processed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	ODBCWatchCall may start the watchdog thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCWatchCall(OdbcConn *connPtr)
+{
+    bool start = NS_FALSE;
+
+    if (connPtr->watchTimeout <= 0 || connPtr->watchStmt == NULL) {
+        return;
+    }
+
+    Ns_MutexLock(&watchdog.lock);
+    Ns_GetTime(&connPtr->deadline);
+    Ns_IncrTime(&connPtr->deadline, (time_t)(connPtr->watchTimeout + WATCHDOG_GRACE), 0);
+    connPtr->timedOut = NS_FALSE;
+    if (!connPtr->watched) {
+        connPtr->watched = NS_TRUE;
+        connPtr->watchPrevPtr = NULL;
+        connPtr->watchNextPtr = watchdog.firstPtr;
+        if (watchdog.firstPtr != NULL) {
+            watchdog.firstPtr->watchPrevPtr = connPtr;
+        }
+        watchdog.firstPtr = connPtr;
+    }
+    if (!watchdog.running) {
+        watchdog.running = NS_TRUE;
+        start = NS_TRUE;
+    } else if (watchdog.wakeup.sec == 0
+               || Ns_DiffTime(&connPtr->deadline, &watchdog.wakeup, NULL) < 0) {
+        Ns_CondSignal(&watchdog.cond);
+    }
+    Ns_MutexUnlock(&watchdog.lock);
+
+    if (start) {
+        Ns_ThreadCreate(ODBCWatchdogThread, NULL, 0, NULL);
+    }
+}
+
+static void
+ODBCUnwatchStmt(OdbcConn *connPtr)
+{
+    if (!connPtr->watched) {
+        return;
+    }
+    Ns_MutexLock(&watchdog.lock);
+    if (connPtr->watchPrevPtr != NULL) {
+        connPtr->watchPrevPtr->watchNextPtr = connPtr->watchNextPtr;
+    } else {
+        watchdog.firstPtr = connPtr->watchNextPtr;
+    }
+    if (connPtr->watchNextPtr != NULL) {
+        connPtr->watchNextPtr->watchPrevPtr = connPtr->watchPrevPtr;
+    }
+    connPtr->watched = NS_FALSE;
+    Ns_MutexUnlock(&watchdog.lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCWatchdogThread -
+ *
+ *	Cancel the watched statements whose deadline has passed, and
+ *	sleep until the next deadline.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Calls SQLCancel from this thread, which ODBC allows for
+ *	statements executing in other threads.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCWatchdogThread(void *UNUSED(arg))
+{
+    OdbcConn *connPtr;
+    Ns_Time   now;
+
+    Ns_ThreadSetName("-odbc-watchdog-");
+
+    Ns_MutexLock(&watchdog.lock);
+    while (!watchdog.shutdown) {
+        Ns_GetTime(&now);
+        watchdog.wakeup.sec = 0;
+        watchdog.wakeup.usec = 0;
+        for (connPtr = watchdog.firstPtr; connPtr != NULL;
+             connPtr = connPtr->watchNextPtr) {
+            if (connPtr->timedOut) {
+                continue;
+            }
+            if (Ns_DiffTime(&connPtr->deadline, &now, NULL) <= 0) {
+                Ns_Log(Warning, "%s[%s]: cancelling statement after query timeout",
+                       connPtr->handle->driver, connPtr->handle->poolname);
+                (void) SQLCancel(connPtr->watchStmt);
+                connPtr->timedOut = NS_TRUE;
+            } else if (watchdog.wakeup.sec == 0
+                       || Ns_DiffTime(&connPtr->deadline, &watchdog.wakeup, NULL) < 0) {
+                watchdog.wakeup = connPtr->deadline;
+            }
+        }
+        if (watchdog.wakeup.sec == 0) {
+            Ns_CondWait(&watchdog.cond, &watchdog.lock);
+        } else {
+            (void) Ns_CondTimedWait(&watchdog.cond, &watchdog.lock, &watchdog.wakeup);
+        }
+    }
+    watchdog.running = NS_FALSE;
+    Ns_MutexUnlock(&watchdog.lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCStatsInit, ODBCStatsReset -
+ *
+ *	Initialize or clear statistics.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCStatsInit(OdbcStats *statsPtr)
+{
+    memset(statsPtr, 0, sizeof(OdbcStats));
+    Tcl_InitHashTable(&statsPtr->errors, TCL_STRING_KEYS);
+}
+
+static void
+ODBCStatsReset(OdbcStats *statsPtr)
+{
+    Tcl_DeleteHashTable(&statsPtr->errors);
+    ODBCStatsInit(statsPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCPhaseDone -
+ *
+ *	Account the time since "startPtr" to a phase of the statement
+ *	processing of the handle, and to the execute or fetch time of the
+ *	current statement.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCPhaseDone(OdbcConn *connPtr, OdbcPhase phase, const Ns_Time *startPtr)
+{
+    OdbcPhaseStats *phasePtr = &connPtr->stats.phases[phase];
+    Ns_Time         now, diff;
+    Tcl_WideInt     us, v;
+    int             bucket = 0;
+
+    Ns_GetTime(&now);
+    (void) Ns_DiffTime(&now, startPtr, &diff);
+    us = (Tcl_WideInt)diff.sec * 1000000 + diff.usec;
+    if (us < 0) {
+        us = 0;
+    }
+    for (v = us; v > 0 && bucket < ODBC_HIST_BUCKETS - 1; v >>= 1) {
+        bucket++;
+    }
+    phasePtr->count++;
+    phasePtr->totalUs += us;
+    if (us > phasePtr->maxUs) {
+        phasePtr->maxUs = us;
+    }
+    phasePtr->histogram[bucket]++;
+
+    if (phase == ODBC_PHASE_EXECUTE) {
+        connPtr->execUs += us;
+    } else if (phase == ODBC_PHASE_FETCH || phase == ODBC_PHASE_GETDATA) {
+        connPtr->fetchUs += us;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCStatsMerge -
+ *
+ *	Add the statistics of the handle to those of its pool.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Clears the statistics of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCStatsMerge(OdbcConn *connPtr)
+{
+    OdbcStats      *fromPtr = &connPtr->stats, *toPtr = &connPtr->poolPtr->stats;
+    Tcl_HashEntry  *hPtr, *toEntry;
+    Tcl_HashSearch  search;
+    int             p, b, isNew;
+
+    if (fromPtr->phases[ODBC_PHASE_ALLOCATE].count == 0
+        && fromPtr->phases[ODBC_PHASE_EXECUTE].count == 0
+        && fromPtr->errors.numEntries == 0
+        && fromPtr->reconnects == 0 && fromPtr->failedReconnects == 0) {
+        return;
+    }
+    Ns_MutexLock(&connPtr->poolPtr->lock);
+    for (p = 0; p < ODBC_PHASES; p++) {
+        OdbcPhaseStats *f = &fromPtr->phases[p], *t = &toPtr->phases[p];
+
+        t->count += f->count;
+        t->totalUs += f->totalUs;
+        if (f->maxUs > t->maxUs) {
+            t->maxUs = f->maxUs;
+        }
+        for (b = 0; b < ODBC_HIST_BUCKETS; b++) {
+            t->histogram[b] += f->histogram[b];
+        }
+    }
+    toPtr->rows += fromPtr->rows;
+    toPtr->bytes += fromPtr->bytes;
+    toPtr->reconnects += fromPtr->reconnects;
+    toPtr->failedReconnects += fromPtr->failedReconnects;
+    toPtr->retries += fromPtr->retries;
+    for (hPtr = Tcl_FirstHashEntry(&fromPtr->errors, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        toEntry = Tcl_CreateHashEntry(&toPtr->errors,
+                                      Tcl_GetHashKey(&fromPtr->errors, hPtr), &isNew);
+        Tcl_SetHashValue(toEntry, INT2PTR(PTR2INT(Tcl_GetHashValue(toEntry))
+                                          + PTR2INT(Tcl_GetHashValue(hPtr))));
+    }
+    Ns_MutexUnlock(&connPtr->poolPtr->lock);
+
+    ODBCStatsReset(fromPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCStatsObj -
+ *
+ *	Convert statistics into a dict with the keys "rows", "bytes",
+ *	"errors" (dict of counts by SQLSTATE) and one key per phase with
+ *	a dict of "count", "total" and "max" (microseconds) and
+ *	"histogram", a list of pairs of upper bound (microseconds,
+ *	exclusive) and count for the nonempty buckets.
+ *
+ * Results:
+ *	New Tcl_Obj.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ODBCStatsObj(const OdbcStats *statsPtr)
+{
+    static const char *const phaseNames[ODBC_PHASES] = {
+        "allocate", "execute", "describe", "fetch", "getdata", "free"
+    };
+    Tcl_Obj              *resultObj = Tcl_NewDictObj(), *errorsObj = Tcl_NewDictObj();
+    const Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch        search;
+    int                   p, b;
+
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("rows", 4),
+                   Tcl_NewWideIntObj(statsPtr->rows));
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("bytes", 5),
+                   Tcl_NewWideIntObj(statsPtr->bytes));
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("reconnects", 10),
+                   Tcl_NewWideIntObj(statsPtr->reconnects));
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("failedreconnects", 16),
+                   Tcl_NewWideIntObj(statsPtr->failedReconnects));
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("retries", 7),
+                   Tcl_NewWideIntObj(statsPtr->retries));
+    for (hPtr = Tcl_FirstHashEntry((Tcl_HashTable *)&statsPtr->errors, &search);
+         hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        Tcl_DictObjPut(NULL, errorsObj,
+                       Tcl_NewStringObj(Tcl_GetHashKey(&statsPtr->errors, hPtr), -1),
+                       Tcl_NewIntObj(PTR2INT(Tcl_GetHashValue(hPtr))));
+    }
+    Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("errors", 6), errorsObj);
+
+    for (p = 0; p < ODBC_PHASES; p++) {
+        const OdbcPhaseStats *phasePtr = &statsPtr->phases[p];
+        Tcl_Obj              *phaseObj = Tcl_NewDictObj(), *histObj = Tcl_NewListObj(0, NULL);
+
+        Tcl_DictObjPut(NULL, phaseObj, Tcl_NewStringObj("count", 5),
+                       Tcl_NewWideIntObj(phasePtr->count));
+        Tcl_DictObjPut(NULL, phaseObj, Tcl_NewStringObj("total", 5),
+                       Tcl_NewWideIntObj(phasePtr->totalUs));
+        Tcl_DictObjPut(NULL, phaseObj, Tcl_NewStringObj("max", 3),
+                       Tcl_NewWideIntObj(phasePtr->maxUs));
+        for (b = 0; b < ODBC_HIST_BUCKETS; b++) {
+            if (phasePtr->histogram[b] > 0) {
+                Tcl_ListObjAppendElement(NULL, histObj, Tcl_NewWideIntObj((Tcl_WideInt)1 << b));
+                Tcl_ListObjAppendElement(NULL, histObj, Tcl_NewWideIntObj(phasePtr->histogram[b]));
+            }
+        }
+        Tcl_DictObjPut(NULL, phaseObj, Tcl_NewStringObj("histogram", 9), histObj);
+        Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj(phaseNames[p], -1), phaseObj);
+    }
+
+    return resultObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCFingerprint -
+ *
+ *	Normalize an SQL statement for the slow query log: string and
+ *	numeric literals are replaced by "?", lists of literals (e.g. of
+ *	IN clauses) are collapsed into a single "?", and whitespace is
+ *	collapsed. Statements differing only in their literals, such as
+ *	those produced by ns_odbc_bind, get the same fingerprint.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Appends the fingerprint to dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCFingerprint(const char *sql, Ns_DString *dsPtr)
+{
+    const char *p = sql;
+    bool        literal;
+
+    while (CHARTYPE(space, *p) != 0) {
+        p++;
+    }
+    while (*p != '\0') {
+        literal = NS_FALSE;
+        if (*p == '\'') {
+            /*
+             * String literal, quotes inside are doubled.
+             */
+            for (p++; *p != '\0'; p++) {
+                if (*p == '\'') {
+                    if (*(p + 1) != '\'') {
+                        p++;
+                        break;
+                    }
+                    p++;
+                }
+            }
+            literal = NS_TRUE;
+        } else if (CHARTYPE(digit, *p) != 0
+                   && (p == sql || !BINDCHAR(*(p - 1)))) {
+            while (CHARTYPE(digit, *p) != 0 || *p == '.') {
+                p++;
+            }
+            if ((*p == 'e' || *p == 'E')
+                && (CHARTYPE(digit, *(p + 1)) != 0
+                    || ((*(p + 1) == '-' || *(p + 1) == '+')
+                        && CHARTYPE(digit, *(p + 2)) != 0))) {
+                p += 2;
+                while (CHARTYPE(digit, *p) != 0) {
+                    p++;
+                }
+            }
+            literal = NS_TRUE;
+        } else if (CHARTYPE(space, *p) != 0) {
+            while (CHARTYPE(space, *p) != 0) {
+                p++;
+            }
+            if (*p != '\0') {
+                Ns_DStringNAppend(dsPtr, " ", 1);
+            }
+            continue;
+        } else {
+            Ns_DStringNAppend(dsPtr, p, 1);
+            p++;
+            continue;
+        }
+
+        if (literal) {
+            int length = Ns_DStringLength(dsPtr);
+
+            /*
+             * Collapse "?, ?" into "?".
+             */
+            if (length >= 3 && strcmp(dsPtr->string + length - 3, "?, ") == 0) {
+                Ns_DStringSetLength(dsPtr, length - 2);
+            } else if (length >= 2 && strcmp(dsPtr->string + length - 2, "?,") == 0) {
+                Ns_DStringSetLength(dsPtr, length - 1);
+            } else {
+                Ns_DStringNAppend(dsPtr, "?", 1);
+            }
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCLogSlowQuery -
+ *
+ *	Called when a timed statement is freed: log it when it took
+ *	longer than the "slowquerytime" of the pool, or when it is
+ *	picked by "slowquerysample", and add it to the aggregated timings
+ *	of its fingerprint.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	May write to the server log.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCLogSlowQuery(Ns_DbHandle *handle)
+{
+    OdbcConn      *connPtr = handle->connection;
+    OdbcPool      *poolPtr = connPtr->poolPtr;
+    OdbcSlowQuery *queryPtr;
+    Tcl_HashEntry *hPtr;
+    Ns_DString     ds;
+    Ns_Time        now, diff;
+    Tcl_WideInt    us;
+    bool           slow;
+    int            isNew;
+
+    Ns_GetTime(&now);
+    (void) Ns_DiffTime(&now, &connPtr->stmtStart, &diff);
+    slow = ((poolPtr->slowQueryTime.sec > 0 || poolPtr->slowQueryTime.usec > 0)
+            && Ns_DiffTime(&diff, &poolPtr->slowQueryTime, NULL) >= 0);
+    if (!slow && (poolPtr->slowQuerySample == 0
+                  || Ns_DRand() * (double)poolPtr->slowQuerySample >= 1.0)) {
+        return;
+    }
+    us = (Tcl_WideInt)diff.sec * 1000000 + diff.usec;
+
+    Ns_DStringInit(&ds);
+    ODBCFingerprint(connPtr->dsSql.string, &ds);
+    Ns_Log(Notice, "%s[%s]: %s query: %.6f s (execute %.6f s, fetch %.6f s), "
+           "%" TCL_LL_MODIFIER "d rows: %s",
+           handle->driver, handle->poolname, slow ? "slow" : "sampled",
+           (double)us / 1e6, (double)connPtr->execUs / 1e6,
+           (double)connPtr->fetchUs / 1e6, connPtr->stmtRows, ds.string);
+
+    Ns_MutexLock(&poolPtr->lock);
+    hPtr = Tcl_FindHashEntry(&poolPtr->slowQueries, ds.string);
+    if (hPtr == NULL && poolPtr->slowQueries.numEntries >= ODBC_MAX_SLOW_QUERIES) {
+        /*
+         * Bound the memory for statements built without bind
+         * variables and not normalized well.
+         */
+        hPtr = Tcl_CreateHashEntry(&poolPtr->slowQueries, "(other)", &isNew);
+    } else if (hPtr == NULL) {
+        hPtr = Tcl_CreateHashEntry(&poolPtr->slowQueries, ds.string, &isNew);
+    }
+    queryPtr = Tcl_GetHashValue(hPtr);
+    if (queryPtr == NULL) {
+        queryPtr = ns_calloc(1u, sizeof(OdbcSlowQuery));
+        Tcl_SetHashValue(hPtr, queryPtr);
+    }
+    queryPtr->count++;
+    queryPtr->totalUs += us;
+    if (us > queryPtr->maxUs) {
+        queryPtr->maxUs = us;
+    }
+    queryPtr->rows += connPtr->stmtRows;
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    Ns_DStringFree(&ds);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCResetHandle -
+ *
+ *	Reset per-request settings of the handle when it is returned to
+ *	the pool, and merge its statistics into those of the pool. An
+ *	open transaction is rolled back, so that handles in the pool are
+ *	always in autocommit mode.
+ *
+ * Results:
+ *	NS_OK.
+ *
+ * Side effects:
+ *	May roll back a transaction.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Ns_ReturnCode
+ODBCResetHandle(Ns_DbHandle *handle)
+{
+    OdbcConn *connPtr = handle->connection;
+
+    if (connPtr != NULL) {
+        if (connPtr->inTransaction) {
+            Ns_Log(Warning, "%s[%s]: handle returned with open transaction, rolling back",
+                   handle->driver, handle->poolname);
+            (void) ODBCEndTran(handle, SQL_ROLLBACK);
+        }
+        connPtr->queryTimeout = -1;
+        ODBCStatsMerge(connPtr);
+    }
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCCachedStmt -
+ *
+ *	Make a prepared statement for the given SQL the current statement
+ *	of the handle. Statements are looked up in the per-handle cache by
+ *	their normalized SQL text; on a miss, a new statement is allocated
+ *	and prepared and added to the cache, evicting the least recently
+ *	used one when the cache is full.
+ *
+ * Results:
+ *	ODBC return code. When a statement was allocated, it is
+ *	available in handle->statement, even when preparing failed.
+ *
+ * Side effects:
+ *	Updates the LRU list of the cache.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCCachedStmt(Ns_DbHandle *handle, const char *sql)
+{
+    OdbcConn       *connPtr = handle->connection;
+    OdbcStmt       *stmtPtr;
+    Tcl_HashEntry  *hPtr;
+    SQLHSTMT        hstmt;
+    SQLRETURN       rc;
+    int             isNew;
+
+    ODBCNormalizeSql(sql, &connPtr->dsKey);
+    hPtr = Tcl_CreateHashEntry(&connPtr->stmts, Ns_DStringValue(&connPtr->dsKey), &isNew);
+    if (isNew == 0) {
+        stmtPtr = Tcl_GetHashValue(hPtr);
+        ODBCUnlinkStmt(connPtr, stmtPtr);
+        ODBCLinkStmt(connPtr, stmtPtr);
+        handle->statement = stmtPtr->hstmt;
+        connPtr->stmtPtr = stmtPtr;
+        return SQL_SUCCESS;
+    }
+
+    rc = ODBCAllocStmt(connPtr, &hstmt);
+    ODBCLog(rc, handle);
+    if (!RC_OK(rc)) {
+        Tcl_DeleteHashEntry(hPtr);
+        return rc;
+    }
+    handle->statement = hstmt;
+    rc = SQLPrepare(hstmt, (SQLCHAR *)sql, SQL_NTS);
+    ODBCLog(rc, handle);
+    if (!RC_OK(rc)) {
+        /*
+         * Leave the statement uncached, it is dropped by ODBCFreeStmt.
+         */
+        Tcl_DeleteHashEntry(hPtr);
+        return rc;
+    }
+    if (connPtr->numStmts >= connPtr->poolPtr->stmtCacheSize) {
+        ODBCDropStmt(connPtr, connPtr->lruTail);
+    }
+    stmtPtr = ns_malloc(sizeof(OdbcStmt));
+    stmtPtr->hstmt = hstmt;
+    stmtPtr->hPtr = hPtr;
+    Tcl_SetHashValue(hPtr, stmtPtr);
+    ODBCLinkStmt(connPtr, stmtPtr);
+    connPtr->numStmts++;
+    connPtr->stmtPtr = stmtPtr;
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCPrepareStmt -
+ *
+ *	Make a prepared statement for the given SQL the current statement
+ *	of the handle, taken from the statement cache when it is enabled.
+ *
+ * Results:
+ *	ODBC return code. When a statement was allocated, it is
+ *	available in handle->statement, even when preparing failed.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCPrepareStmt(Ns_DbHandle *handle, const char *sql)
+{
+    OdbcConn       *connPtr = handle->connection;
+    SQLHSTMT        hstmt;
+    SQLRETURN       rc;
+
+    if (connPtr->poolPtr->stmtCacheSize > 0) {
+        return ODBCCachedStmt(handle, sql);
+    }
+    rc = ODBCAllocStmt(connPtr, &hstmt);
+    ODBCLog(rc, handle);
+    if (RC_OK(rc)) {
+        handle->statement = hstmt;
+        rc = SQLPrepare(hstmt, (SQLCHAR *)sql, SQL_NTS);
+        ODBCLog(rc, handle);
+    }
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCExecChunk -
+ *
+ *	Execute the prepared statement of the handle for "nrows" sets of
+ *	parameters at once. The values are given row by row, NULL or the
+ *	empty string are passed as SQL NULL. Without "sizes", they are
+ *	NUL terminated strings, otherwise "sizes" holds their lengths and
+ *	values starting with "quote" are unquoted (see ODBCCopyField).
+ *	They are copied into column wise parameter arrays and sent with
+ *	SQL_ATTR_PARAMSET_SIZE. When the driver does not support
+ *	parameter arrays, the rows are sent one by one.
+ *
+ * Results:
+ *	ODBC return code of the last SQLExecute. The status of every row
+ *	is left in "status" (SQL_PARAM_SUCCESS, SQL_PARAM_ERROR, ...).
+ *
+ * Side effects:
+ *	Database is modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCExecChunk(Ns_DbHandle *handle, int nparams, int nrows, const char **values,
+              const size_t *sizes, char quote, SQLUSMALLINT *status)
+{
+    SQLHSTMT        hstmt = (SQLHSTMT) handle->statement;
+    SQLULEN         processed = 0u, paramsetSize = (SQLULEN)nrows;
+    SQLLEN         *widths, *lengths;
+    Ns_Time         start;
+    SQLRETURN       rc;
+    size_t          size;
+    char           *buf, *p;
+    int             i, j;
+
+    for (i = 0; i < nrows; i++) {
+        status[i] = SQL_PARAM_UNUSED;
+    }
+    ODBCWatchStmt(handle);
+
+    /*
+     * Determine the width of every parameter array.
+     */
+    widths = ns_calloc((size_t)nparams + 1u, sizeof(SQLLEN));
+    for (i = 0; i < nrows; i++) {
+        for (j = 0; j < nparams; j++) {
+            const char *value = values[i * nparams + j];
+            SQLLEN      length = (value == NULL) ? 0
+                : (SQLLEN)((sizes != NULL) ? sizes[i * nparams + j] : strlen(value));
+
+            if (length + 1 > widths[j]) {
+                widths[j] = length + 1;
+            }
+        }
+    }
+    size = (size_t)nparams * (size_t)nrows * sizeof(SQLLEN);
+    for (j = 0; j < nparams; j++) {
+        size += (size_t)widths[j] * (size_t)nrows;
+    }
+    buf = ns_malloc(size + 1u);
+    lengths = (SQLLEN *)(void *)buf;
+    p = buf + (size_t)nparams * (size_t)nrows * sizeof(SQLLEN);
+
+    rc = SQLSetStmtAttr(hstmt, SQL_ATTR_PARAM_BIND_TYPE,
+                        (SQLPOINTER)SQL_PARAM_BIND_BY_COLUMN, 0);
+    if (RC_OK(rc)) {
+        rc = SQLSetStmtAttr(hstmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER)paramsetSize, 0);
+        if (rc == SQL_SUCCESS_WITH_INFO) {
+            /*
+             * Option value changed, the driver supports fewer rows.
+             */
+            (void) SQLGetStmtAttr(hstmt, SQL_ATTR_PARAMSET_SIZE, &paramsetSize, 0, NULL);
+        }
+    }
+    if (!RC_OK(rc) || paramsetSize != (SQLULEN)nrows) {
+        paramsetSize = 1u;
+        (void) SQLSetStmtAttr(hstmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER)1, 0);
+        rc = SQL_SUCCESS;
+    }
+    if (RC_OK(rc)) {
+        rc = SQLSetStmtAttr(hstmt, SQL_ATTR_PARAM_STATUS_PTR, status, 0);
+    }
+    if (RC_OK(rc)) {
+        rc = SQLSetStmtAttr(hstmt, SQL_ATTR_PARAMS_PROCESSED_PTR, &processed, 0);
+    }
+
+    /*
+     * Copy the values into the parameter arrays.
+     */
+    for (j = 0; RC_OK(rc) && j < nparams; j++) {
+        SQLLEN *lengthPtr = &lengths[j * nrows];
+
+        for (i = 0; i < nrows; i++) {
+            const char *value = values[i * nparams + j];
+            char       *dest = p + (size_t)i * (size_t)widths[j];
+
+            if (value == NULL) {
+                lengthPtr[i] = 0;
+                *dest = '\0';
+            } else if (sizes != NULL) {
+                lengthPtr[i] = (SQLLEN)ODBCCopyField(dest, value, sizes[i * nparams + j],
+                                                     quote);
+            } else {
+                lengthPtr[i] = (SQLLEN)strlen(value);
+                memcpy(dest, value, (size_t)lengthPtr[i] + 1u);
+            }
+            if (lengthPtr[i] == 0) {
+                lengthPtr[i] = SQL_NULL_DATA;
+            }
+        }
+        rc = SQLBindParameter(hstmt, (SQLUSMALLINT)(j + 1), SQL_PARAM_INPUT,
+                              SQL_C_CHAR, SQL_VARCHAR,
+                              widths[j] > 1 ? (SQLULEN)(widths[j] - 1) : 1u, 0,
+                              p, widths[j], lengthPtr);
+        p += (size_t)widths[j] * (size_t)nrows;
+    }
+    ODBCLog(rc, handle);
+
+    if (RC_OK(rc) && paramsetSize == (SQLULEN)nrows) {
+        Ns_GetTime(&start);
+        ODBCWatchCall(handle->connection);
+        rc = SQLExecute(hstmt);
+        ODBCUnwatchStmt(handle->connection);
+        ODBCPhaseDone(handle->connection, ODBC_PHASE_EXECUTE, &start);
+        ODBCLog(rc, handle);
+        if (RC_OK(rc) || rc == SQL_NO_DATA) {
+            /*
+             * Drivers not maintaining the status array leave the rows
+             * marked as unused.
+             */
+            for (i = 0; i < nrows; i++) {
+                if (status[i] == SQL_PARAM_UNUSED
+                    && (processed == 0u || (SQLULEN)i < processed)) {
+                    status[i] = SQL_PARAM_SUCCESS;
+                }
+            }
+        }
+    } else if (RC_OK(rc)) {
+        /*
+         * No parameter arrays, rebind the parameters for every row.
+         */
+        for (i = 0; i < nrows; i++) {
+            p = buf + (size_t)nparams * (size_t)nrows * sizeof(SQLLEN);
+            for (j = 0; RC_OK(rc) && j < nparams; j++) {
+                rc = SQLBindParameter(hstmt, (SQLUSMALLINT)(j + 1), SQL_PARAM_INPUT,
+                                      SQL_C_CHAR, SQL_VARCHAR,
+                                      widths[j] > 1 ? (SQLULEN)(widths[j] - 1) : 1u, 0,
+                                      p + (size_t)i * (size_t)widths[j], widths[j],
+                                      &lengths[j * nrows + i]);
+                p += (size_t)widths[j] * (size_t)nrows;
+            }
+            if (RC_OK(rc)) {
+                Ns_GetTime(&start);
+                ODBCWatchCall(handle->connection);
+                rc = SQLExecute(hstmt);
+                ODBCUnwatchStmt(handle->connection);
+                ODBCPhaseDone(handle->connection, ODBC_PHASE_EXECUTE, &start);
+                ODBCLog(rc, handle);
+            }
+            status[i] = (RC_OK(rc) || rc == SQL_NO_DATA) ? SQL_PARAM_SUCCESS : SQL_PARAM_ERROR;
+            rc = SQL_SUCCESS;
+        }
+    }
+
+    (void) SQLFreeStmt(hstmt, SQL_RESET_PARAMS);
+    (void) SQLSetStmtAttr(hstmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER)1, 0);
+    (void) SQLSetStmtAttr(hstmt, SQL_ATTR_PARAM_STATUS_PTR, NULL, 0);
+    (void) SQLSetStmtAttr(hstmt, SQL_ATTR_PARAMS_PROCESSED_PTR, NULL, 0);
+    ns_free(widths);
+    ns_free(buf);
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCLinkStmt, ODBCUnlinkStmt -
+ *
+ *	Add a cached statement to the front of the LRU list of the
+ *	handle, or remove it from the list.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCLinkStmt(OdbcConn *connPtr, OdbcStmt *stmtPtr)
+{
+    stmtPtr->prevPtr = NULL;
+    stmtPtr->nextPtr = connPtr->lruHead;
+    if (connPtr->lruHead != NULL) {
+        connPtr->lruHead->prevPtr = stmtPtr;
+    } else {
+        connPtr->lruTail = stmtPtr;
+    }
+    connPtr->lruHead = stmtPtr;
+}
+
+static void
+ODBCUnlinkStmt(OdbcConn *connPtr, const OdbcStmt *stmtPtr)
+{
+    if (stmtPtr->prevPtr != NULL) {
+        stmtPtr->prevPtr->nextPtr = stmtPtr->nextPtr;
+    } else {
+        connPtr->lruHead = stmtPtr->nextPtr;
+    }
+    if (stmtPtr->nextPtr != NULL) {
+        stmtPtr->nextPtr->prevPtr = stmtPtr->prevPtr;
+    } else {
+        connPtr->lruTail = stmtPtr->prevPtr;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCDropStmt -
+ *
+ *	Remove a statement from the statement cache and free it.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The ODBC statement is dropped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCDropStmt(OdbcConn *connPtr, OdbcStmt *stmtPtr)
+{
+    ODBCUnlinkStmt(connPtr, stmtPtr);
+    Tcl_DeleteHashEntry(stmtPtr->hPtr);
+    (void) ODBCDropHstmt(connPtr, stmtPtr->hstmt);
+    connPtr->numStmts--;
+    ns_free(stmtPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCNormalizeSql -
+ *
+ *	Compute the statement cache key of an SQL string: leading and
+ *	trailing white space is removed, and runs of white space outside
+ *	of quotes are collapsed into a single space. From the first
+ *	comment, backslash or dollar sign on, where the quoting rules
+ *	differ between databases, the rest is kept verbatim.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The key is left in the given Ns_DString.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCNormalizeSql(const char *sql, Ns_DString *dsPtr)
+{
+    const char *p, *start;
+    char        quote = '\0';
+
+    Ns_DStringSetLength(dsPtr, 0);
+    while (CHARTYPE(space, *sql) != 0) {
+        sql++;
+    }
+    for (p = start = sql; *p != '\0'; p++) {
+        if (*p == '\\' || *p == '$' || (*p == '-' && *(p + 1) == '-')
+            || (*p == '/' && *(p + 1) == '*')) {
+            p += strlen(p);
+            break;
+        } else if (quote != '\0') {
+            if (*p == quote) {
+                quote = '\0';
+            }
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (CHARTYPE(space, *p) != 0) {
+            Ns_DStringNAppend(dsPtr, start, (int)(p - start));
+            while (CHARTYPE(space, *(p + 1)) != 0) {
+                p++;
+            }
+            if (*(p + 1) != '\0') {
+                Ns_DStringNAppend(dsPtr, " ", 1);
+            }
+            start = p + 1;
+        }
+    }
+    Ns_DStringNAppend(dsPtr, start, (int)(p - start));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCAddParam -
+ *
+ *	Add a value for the next "?" placeholder of the statement to be
+ *	executed by the next ODBCExec. The empty string is passed as NULL,
+ *	as with the emulated bind variables. The value is not copied and
+ *	must stay valid until the statement was executed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	May grow the parameter array of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ODBCAddParam(OdbcConn *connPtr, const char *value)
+{
+    OdbcParam *paramPtr;
+
+    if (connPtr->numParams == connPtr->maxParams) {
+        connPtr->maxParams = connPtr->maxParams * 2 + 8;
+        connPtr->params = ns_realloc(connPtr->params,
+                                     (size_t)connPtr->maxParams * sizeof(OdbcParam));
+    }
+    paramPtr = &connPtr->params[connPtr->numParams++];
+    if (*value == '\0') {
+        paramPtr->value = NULL;
+        paramPtr->length = SQL_NULL_DATA;
+    } else {
+        paramPtr->value = value;
+        paramPtr->length = (SQLLEN)strlen(value);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCBindParams -
+ *
+ *	Bind the collected parameter values to the prepared statement of
+ *	the handle. All values are passed as character data, conversion
+ *	to the column types is left to the driver and the database.
+ *
+ * Results:
+ *	ODBC return code.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SQLRETURN
+ODBCBindParams(Ns_DbHandle *handle)
+{
+    OdbcConn       *connPtr = handle->connection;
+    SQLHSTMT        hstmt = (SQLHSTMT) handle->statement;
+    SQLRETURN       rc = SQL_SUCCESS;
+    int             i;
+
+    for (i = 0; RC_OK(rc) && i < connPtr->numParams; i++) {
+        OdbcParam *paramPtr = &connPtr->params[i];
+        SQLLEN     length = paramPtr->length > 0 ? paramPtr->length : 0;
+
+        rc = SQLBindParameter(hstmt, (SQLUSMALLINT)(i + 1), SQL_PARAM_INPUT,
+                              SQL_C_CHAR, SQL_VARCHAR,
+                              length > 0 ? (SQLULEN)length : 1u, 0,
+                              (SQLPOINTER)paramPtr->value, length,
+                              &paramPtr->length);
+    }
+    ODBCLog(rc, handle);
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCBindRow -
+ *
+ *	Bind row after an ODBCExec which returned NS_ROWS.
+ *
+ * Results:
+ *	NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *	Given Ns_Set is modified with column names.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Ns_Set *
+ODBCBindRow(Ns_DbHandle *handle)
+{
+    Ns_Set         *row;
+    SQLSMALLINT     i;
+    OdbcConn       *connPtr;
+    Ns_Time         start;
+
+    if (!handle->fetchingRows) {
+        Ns_Log(Error, "%s[%s]: no waiting rows",
+               handle->driver, handle->poolname);
+        return NULL;
+    }
+    connPtr = handle->connection;
+    row = handle->row;
+    Ns_GetTime(&start);
+    if (!ODBCDescribeColumns(handle) || !ODBCBindColumns(handle, NS_TRUE)) {
+        ODBCFreeStmt(handle);
+        return NULL;
+    }
+    ODBCPhaseDone(connPtr, ODBC_PHASE_DESCRIBE, &start);
+    for (i = 0; i < connPtr->numCols; i++) {
+        Ns_SetPut(row, connPtr->columns[i].name, NULL);
+    }
+    return row;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCDescribeColumns -
+ *
+ *	Capture the shape of the current result set: number of columns
+ *	and, per column, name, SQL type, size, scale and nullability.
+ *	The descriptor stays valid until the next result set and is used
+ *	for all rows of the current one.
+ *
+ * Results:
+ *	NS_FALSE on ODBC errors, NS_TRUE otherwise.
+ *
+ * Side effects:
+ *	Fills connPtr->columns and connPtr->dsNames.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCDescribeColumns(Ns_DbHandle *handle)
+{
+    OdbcConn       *connPtr = handle->connection;
+    SQLHSTMT        hstmt = (SQLHSTMT) handle->statement;
+    Ns_DString     *dsPtr = &connPtr->dsNames;
+    const char     *name;
+    SQLSMALLINT     numcols, cbcolname;
+    SQLUSMALLINT    i;
+    SQLRETURN       rc;
+
+    ODBCResetColumns(connPtr);
+    connPtr->numCols = 0;
+    rc = SQLNumResultCols(hstmt, &numcols);
+    ODBCLog(rc, handle);
+    if (!RC_OK(rc)) {
+        return NS_FALSE;
+    }
+    if (numcols > connPtr->maxCols) {
+        ns_free(connPtr->columns);
+        connPtr->columns = ns_calloc((size_t)numcols, sizeof(OdbcColumn));
+        connPtr->maxCols = numcols;
+    }
+
+    /*
+     * Collect the names in a single string, each terminated by a NUL
+     * character, and set up the pointers once all are in place.
+     */
+    Ns_DStringSetLength(dsPtr, 0);
+    for (i = 0u; i < (SQLUSMALLINT)numcols; i++) {
+        OdbcColumn *colPtr = &connPtr->columns[i];
+        int         offset = Ns_DStringLength(dsPtr);
+
+        Ns_DStringSetLength(dsPtr, offset + MAX_IDENTIFIER);
+        rc = SQLDescribeCol(hstmt, (SQLUSMALLINT)(i + 1u),
+                            (SQLCHAR *)dsPtr->string + offset, MAX_IDENTIFIER,
+                            &cbcolname, &colPtr->sqlType, &colPtr->size,
+                            &colPtr->scale, &colPtr->nullable);
+        if (RC_OK(rc) && cbcolname >= MAX_IDENTIFIER) {
+            Ns_DStringSetLength(dsPtr, offset + cbcolname + 1);
+            rc = SQLDescribeCol(hstmt, (SQLUSMALLINT)(i + 1u),
+                                (SQLCHAR *)dsPtr->string + offset,
+                                (SQLSMALLINT)(cbcolname + 1),
+                                &cbcolname, &colPtr->sqlType, &colPtr->size,
+                                &colPtr->scale, &colPtr->nullable);
+        }
+        ODBCLog(rc, handle);
+        if (!RC_OK(rc)) {
+            return NS_FALSE;
+        }
+        Ns_DStringSetLength(dsPtr, offset + cbcolname + 1);
+    }
+    name = Ns_DStringValue(dsPtr);
+    for (i = 0u; i < (SQLUSMALLINT)numcols; i++) {
+        connPtr->columns[i].name = name;
+        name += strlen(name) + 1u;
+    }
+    connPtr->numCols = numcols;
+
+    return NS_TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCBindColumns -
+ *
+ *	Set up the column buffers for the current result set. All buffers
+ *	are carved out of the per-handle arena, which is only reallocated
+ *	when a result set needs more space than any previous one.
+ *
+ *	When block fetching is allowed, the pool has a rowset size larger
+ *	than one and all columns have a bounded display size, every column is bound with
+ *	SQLBindCol to an array of "rowsetSize" values, such that a single
+ *	SQLFetch returns a whole rowset. Otherwise, the result set is
+ *	fetched row by row via SQLGetData into buffers sized from the
+ *	column definitions.
+ *
+ * Results:
+ *	NS_FALSE on ODBC errors, NS_TRUE otherwise.
+ *
+ * Side effects:
+ *	May grow the arena, sets statement attributes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ODBCBindColumns(Ns_DbHandle *handle, bool allowBlock)
+{
+    OdbcConn       *connPtr = handle->connection;
+    SQLHSTMT        hstmt = (SQLHSTMT) handle->statement;
+    SQLLEN          maxBindSize = connPtr->poolPtr->maxBindSize;
+    SQLULEN         rowsetSize = allowBlock ? connPtr->poolPtr->rowsetSize : 1u;
+    SQLUSMALLINT    i;
+    SQLLEN          displaySize;
+    size_t          size;
+    char           *p;
+    RETCODE         rc;
+
+    connPtr->blockFetch = NS_FALSE;
+    connPtr->rowsFetched = 0u;
+    connPtr->rowIndex = 0u;
+
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols && rowsetSize > 1u; i++) {
+        OdbcColumn *colPtr = &connPtr->columns[i];
+
+        rc = SQLColAttribute(hstmt, (SQLUSMALLINT)(i + 1u), SQL_DESC_DISPLAY_SIZE,
+                             NULL, 0, NULL, &displaySize);
+        ODBCLog(rc, handle);
+        if (!RC_OK(rc)) {
+            return NS_FALSE;
+        }
+        switch (colPtr->sqlType) {
+        case SQL_CHAR:
+        case SQL_VARCHAR:
+        case SQL_WCHAR:
+        case SQL_WVARCHAR:
+            /*
+             * The display size counts characters, values are
+             * returned UTF-8 encoded.
+             */
+            colPtr->width = displaySize * 4 + 1;
+            break;
+        default:
+            colPtr->width = displaySize + 1;
+            break;
+        }
+        if (displaySize <= 0 || colPtr->width > maxBindSize) {
+            Ns_Log(Debug, "%s[%s]: column %hu too wide for block fetch",
+                   handle->driver, handle->poolname, (unsigned short)(i + 1u));
+            rowsetSize = 1u;
+        }
+    }
+
+    if (rowsetSize == 1u) {
+        /*
+         * Row by row fetching: one buffer per column, sized from the
+         * column size. Longer values are assembled in dsValue.
+         */
+        for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+            OdbcColumn *colPtr = &connPtr->columns[i];
+
+            if (colPtr->size == 0u || colPtr->size > (SQLULEN)maxBindSize) {
+                colPtr->width = maxBindSize;
+            } else {
+                colPtr->width = (SQLLEN)colPtr->size * 4 + 1;
+                if (colPtr->width < 64) {
+                    colPtr->width = 64;
+                } else if (colPtr->width > maxBindSize) {
+                    colPtr->width = maxBindSize;
+                }
+            }
+        }
+    }
+
+    /*
+     * Lay out the arena: length indicators and row status first, to
+     * keep them aligned, then the column data.
+     */
+    size = rowsetSize * (sizeof(SQLLEN) * (size_t)connPtr->numCols
+                         + sizeof(SQLUSMALLINT));
+    size = (size + sizeof(SQLLEN) - 1u) & ~(sizeof(SQLLEN) - 1u);
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        size += rowsetSize * (size_t)connPtr->columns[i].width;
+    }
+    if (size > connPtr->arenaSize) {
+        ns_free(connPtr->arena);
+        connPtr->arena = ns_malloc(size);
+        connPtr->arenaSize = size;
+    }
+    p = connPtr->arena;
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        connPtr->columns[i].lengths = (SQLLEN *)(void *)p;
+        p += rowsetSize * sizeof(SQLLEN);
+    }
+    connPtr->rowStatus = (SQLUSMALLINT *)(void *)p;
+    p += rowsetSize * sizeof(SQLUSMALLINT);
+    p = connPtr->arena + (((size_t)(p - connPtr->arena) + sizeof(SQLLEN) - 1u)
+                          & ~(sizeof(SQLLEN) - 1u));
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        connPtr->columns[i].data = (SQLCHAR *)p;
+        p += rowsetSize * (size_t)connPtr->columns[i].width;
+    }
+
+    if (rowsetSize == 1u) {
+        return NS_TRUE;
+    }
+
+    rc = SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_BIND_TYPE,
+                        (SQLPOINTER)SQL_BIND_BY_COLUMN, 0);
+    if (RC_OK(rc)) {
+        rc = SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_ARRAY_SIZE,
+                            (SQLPOINTER)rowsetSize, 0);
+    }
+    if (RC_OK(rc)) {
+        rc = SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_STATUS_PTR,
+                            connPtr->rowStatus, 0);
+    }
+    if (RC_OK(rc)) {
+        rc = SQLSetStmtAttr(hstmt, SQL_ATTR_ROWS_FETCHED_PTR,
+                            &connPtr->rowsFetched, 0);
+    }
+    for (i = 0u; RC_OK(rc) && i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        OdbcColumn *colPtr = &connPtr->columns[i];
+
+        rc = SQLBindCol(hstmt, (SQLUSMALLINT)(i + 1u), SQL_C_CHAR,
+                        colPtr->data, colPtr->width, colPtr->lengths);
+    }
+    ODBCLog(rc, handle);
+    if (!RC_OK(rc)) {
+        return NS_FALSE;
+    }
+    connPtr->blockFetch = NS_TRUE;
+    return NS_TRUE;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * ODBCShutdown -
+ * ODBCResetColumns -
  *
- *	Callback to clean up driver on server shutdown.
+ *	Forget the column buffers of the current result set. The arena
+ *	is kept for the next result set of the handle.
  *
  * Results:
- *	Resources are freed.
+ *	None.
  *
  * Side effects:
- *	None.
+ *	Block-cursor mode is turned off, long value buffer is released.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-ODBCShutdown(const Ns_Time *UNUSED(timeoutPtr), void *arg)
+ODBCResetColumns(OdbcConn *connPtr)
 {
-    HENV           henv = arg;
-    RETCODE        rc;
-    Ns_LogSeverity severity;
+    SQLSMALLINT i;
 
-    rc = SQLFreeEnv(henv);
-    if (rc == SQL_SUCCESS_WITH_INFO) {
-        severity = Warning;
-    } else if (rc == SQL_ERROR) {
-        severity = Error;
-    } else {
-        return;
+    if (connPtr->columns != NULL) {
+        for (i = 0; i < connPtr->numCols; i++) {
+            connPtr->columns[i].data = NULL;
+            connPtr->columns[i].lengths = NULL;
+        }
     }
-    Ns_Log(severity, "odbc shutdown retorts problem");
+    connPtr->rowStatus = NULL;
+    connPtr->blockFetch = NS_FALSE;
+    Ns_DStringFree(&connPtr->dsValue);
 }
 
 
-
 /*
  *----------------------------------------------------------------------
  *
- * ODBCName -
+ * ODBCGetData -
  *
- *	Return the ODBC driver name.
+ *	Retrieve the value of a column of the current row with
+ *	SQLGetData as character (SQL_C_CHAR) or binary (SQL_C_BINARY)
+ *	data. Values not fitting into the column buffer are assembled
+ *	from multiple chunks in the handle's dsValue, so nothing is
+ *	truncated.
  *
  * Results:
- *	Pointer to static string name.
+ *	ODBC return code. On success, *valuePtr points to the value or
+ *	is NULL for SQL NULL values, and *lengthPtr is set to its length
+ *	in bytes. The value is valid until the next call.
  *
  * Side effects:
- *	None.
+ *	May grow dsValue.
  *
  *----------------------------------------------------------------------
  */
 
-static const char *
-ODBCName(void)
+static SQLRETURN
+ODBCGetData(Ns_DbHandle *handle, SQLUSMALLINT i, SQLSMALLINT cType,
+            const char **valuePtr, SQLLEN *lengthPtr)
 {
-    return odbcName;
+    OdbcConn        *connPtr = handle->connection;
+    const OdbcColumn *colPtr = &connPtr->columns[i];
+    SQLHSTMT         hstmt = (SQLHSTMT) handle->statement;
+    Ns_DString      *dsPtr = &connPtr->dsValue;
+    SQLLEN           cbvalue, avail, offset;
+    SQLLEN           term = (cType == SQL_C_CHAR) ? 1 : 0;
+    SQLRETURN        rc;
+
+    rc = SQLGetData(hstmt, (SQLUSMALLINT)(i + 1u), cType,
+                    colPtr->data, colPtr->width, &cbvalue);
+    if (rc != SQL_SUCCESS_WITH_INFO
+        || (cbvalue != SQL_NO_TOTAL && cbvalue <= colPtr->width - term)) {
+        ODBCLog(rc, handle);
+        if (RC_OK(rc)) {
+            *valuePtr = (cbvalue == SQL_NULL_DATA) ? NULL : (char *)colPtr->data;
+            *lengthPtr = (cbvalue == SQL_NULL_DATA) ? 0 : cbvalue;
+            connPtr->stats.bytes += *lengthPtr;
+        }
+        return rc;
+    }
+
+    /*
+     * The value was truncated (SQLSTATE 01004). Collect the remaining
+     * chunks, sized after the reported total length when available.
+     */
+    Ns_DStringSetLength(dsPtr, 0);
+    Ns_DStringNAppend(dsPtr, (char *)colPtr->data, (int)(colPtr->width - term));
+    avail = colPtr->width;
+    do {
+        offset = Ns_DStringLength(dsPtr);
+        if (cbvalue == SQL_NO_TOTAL) {
+            avail = offset + term;
+        } else {
+            avail = cbvalue - (avail - term) + term;
+        }
+        Ns_DStringSetLength(dsPtr, (int)(offset + avail));
+        rc = SQLGetData(hstmt, (SQLUSMALLINT)(i + 1u), cType,
+                        dsPtr->string + offset, avail, &cbvalue);
+        if (rc == SQL_NO_DATA) {
+            Ns_DStringSetLength(dsPtr, (int)offset);
+            break;
+        } else if (rc == SQL_SUCCESS_WITH_INFO
+                   && (cbvalue == SQL_NO_TOTAL || cbvalue > avail - term)) {
+            Ns_DStringSetLength(dsPtr, (int)(offset + avail - term));
+        } else {
+            ODBCLog(rc, handle);
+            if (!RC_OK(rc)) {
+                return rc;
+            }
+            Ns_DStringSetLength(dsPtr, (int)(offset + cbvalue));
+            break;
+        }
+    } while (NS_TRUE);
+
+    *valuePtr = Ns_DStringValue(dsPtr);
+    *lengthPtr = Ns_DStringLength(dsPtr);
+    connPtr->stats.bytes += *lengthPtr;
+    return SQL_SUCCESS;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * ODBCOpenDb -
+ * ODBCGetObj -
  *
- *	Open an ODBC datasource.
+ *	Retrieve the value of a column of the current row as a Tcl_Obj
+ *	with an internal representation matching the SQL type: integers
+ *	are fetched as SQL_C_SBIGINT, floating point values and decimals
+ *	with up to 15 digits as SQL_C_DOUBLE, binary data as byte array.
+ *	Dates and timestamps are fetched as structures and formatted in
+ *	ISO format, everything else is fetched as character data.
  *
  * Results:
- *	NS_OK or NS_ERROR.
+ *	ODBC return code. On success, *objPtr is the new value with
+ *	refcount 0, or NULL for SQL NULL values.
  *
  * Side effects:
- *	Performs both SQLAllocConnect and SQLConnect.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-ODBCOpenDb(Ns_DbHandle *handle)
+static SQLRETURN
+ODBCGetObj(Ns_DbHandle *handle, SQLUSMALLINT i, Tcl_Obj **objPtr)
 {
-    SQLHDBC         hdbc;
-    RETCODE         rc;
-
-    assert(handle != NULL);
-    assert(handle->datasource != NULL);
-
-    handle->connected = NS_FALSE;
-    handle->connection = NULL;
-    handle->statement = NULL;
+    const OdbcColumn *colPtr = &((OdbcConn *) handle->connection)->columns[i];
+    SQLHSTMT         hstmt = (SQLHSTMT) handle->statement;
+    SQLUSMALLINT     col = (SQLUSMALLINT)(i + 1u);
+    SQLLEN           cbvalue;
+    SQLRETURN        rc;
+    const char      *value;
+    char             buf[64];
+
+    *objPtr = NULL;
+    switch (colPtr->sqlType) {
+    case SQL_DECIMAL:
+    case SQL_NUMERIC:
+        if (colPtr->size > 15u) {
+            goto chardata;
+        } else if (colPtr->scale > 0) {
+            goto doubledata;
+        }
+        /* FALLTHROUGH */
+    case SQL_BIT:
+    case SQL_TINYINT:
+    case SQL_SMALLINT:
+    case SQL_INTEGER:
+    case SQL_BIGINT: {
+        SQLBIGINT v;
+
+        rc = SQLGetData(hstmt, col, SQL_C_SBIGINT, &v, 0, &cbvalue);
+        if (RC_OK(rc) && cbvalue != SQL_NULL_DATA) {
+            *objPtr = Tcl_NewWideIntObj((Tcl_WideInt)v);
+        }
+        break;
+    }
+    case SQL_REAL:
+    case SQL_FLOAT:
+    case SQL_DOUBLE:
+    doubledata: {
+        SQLDOUBLE v;
+
+        rc = SQLGetData(hstmt, col, SQL_C_DOUBLE, &v, 0, &cbvalue);
+        if (RC_OK(rc) && cbvalue != SQL_NULL_DATA) {
+            *objPtr = Tcl_NewDoubleObj(v);
+        }
+        break;
+    }
+    case SQL_TYPE_DATE: {
+        SQL_DATE_STRUCT v;
 
-    rc = SQLAllocConnect(odbcenv, &hdbc);
-    handle->connection = (void *) hdbc;
-    ODBCLog(rc, handle);
-    if (!RC_OK(rc)) {
-        handle->connection = NULL;
-        SQLFreeConnect(hdbc);
-        return NS_ERROR;
+        rc = SQLGetData(hstmt, col, SQL_C_TYPE_DATE, &v, 0, &cbvalue);
+        if (RC_OK(rc) && cbvalue != SQL_NULL_DATA) {
+            *objPtr = Tcl_NewStringObj(buf, snprintf(buf, sizeof(buf), "%04d-%02u-%02u",
+                                                     (int)v.year, v.month, v.day));
+        }
+        break;
+    }
+    case SQL_TYPE_TIMESTAMP: {
+        SQL_TIMESTAMP_STRUCT v;
+        int                  n;
+
+        rc = SQLGetData(hstmt, col, SQL_C_TYPE_TIMESTAMP, &v, 0, &cbvalue);
+        if (RC_OK(rc) && cbvalue != SQL_NULL_DATA) {
+            n = snprintf(buf, sizeof(buf), "%04d-%02u-%02u %02u:%02u:%02u",
+                         (int)v.year, v.month, v.day, v.hour, v.minute, v.second);
+            if (v.fraction != 0u) {
+                /*
+                 * The fraction is given in nanoseconds.
+                 */
+                n += snprintf(buf + n, sizeof(buf) - (size_t)n, ".%06u",
+                              (unsigned)(v.fraction / 1000u));
+            }
+            *objPtr = Tcl_NewStringObj(buf, n);
+        }
+        break;
+    }
+    case SQL_BINARY:
+    case SQL_VARBINARY:
+    case SQL_LONGVARBINARY:
+        rc = ODBCGetData(handle, i, SQL_C_BINARY, &value, &cbvalue);
+        if (RC_OK(rc) && value != NULL) {
+            *objPtr = Tcl_NewByteArrayObj((const unsigned char *)value, (int)cbvalue);
+        }
+        return rc;
+    default:
+    chardata:
+        rc = ODBCGetData(handle, i, SQL_C_CHAR, &value, &cbvalue);
+        if (RC_OK(rc) && value != NULL) {
+            *objPtr = Tcl_NewStringObj(value, (int)cbvalue);
+        }
+        return rc;
     }
-    Ns_Log(Notice, "%s[%s]: attemping to open '%s'",
-           handle->driver, handle->poolname, handle->datasource);
-    rc = SQLConnect(hdbc,
-                    (SQLCHAR *)handle->datasource, SQL_NTS,
-                    (SQLCHAR *)handle->user, SQL_NTS,
-                    (SQLCHAR *)handle->password, SQL_NTS);
     ODBCLog(rc, handle);
-    if (!SQL_SUCCEEDED(rc)) {
-        handle->connection = NULL;
-        SQLFreeConnect(hdbc);
-        return NS_ERROR;
+    if (RC_OK(rc) && cbvalue > 0) {
+        ((OdbcConn *) handle->connection)->stats.bytes += cbvalue;
     }
-    handle->connection = (void *) hdbc;
-    handle->connected = NS_TRUE;
-    return NS_OK;
+
+    return rc;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * ODBCCloseDb -
+ * ODBCSQLFetch -
  *
- *	Close an ODBC datasource.
+ *	Call SQLFetch and account the time and fetched rows.
  *
  * Results:
- *	NS_OK or NS_ERROR.
+ *	ODBC return code.
  *
  * Side effects:
- *	Performs both SQLDisconnect and SQLFreeConnect.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static Ns_ReturnCode
-ODBCCloseDb(Ns_DbHandle *handle)
+static SQLRETURN
+ODBCSQLFetch(Ns_DbHandle *handle)
 {
-    RETCODE         rc;
-    SQLHDBC         hdbc;
-
-    hdbc = (SQLHDBC) handle->connection;
-    handle->connection = NULL;
-    handle->connected = NS_FALSE;
+    OdbcConn  *connPtr = handle->connection;
+    Ns_Time    start;
+    SQLRETURN  rc;
+
+    Ns_GetTime(&start);
+    ODBCWatchCall(connPtr);
+    rc = SQLFetch((SQLHSTMT) handle->statement);
+    ODBCUnwatchStmt(connPtr);
+    ODBCPhaseDone(connPtr, ODBC_PHASE_FETCH, &start);
+    if (RC_OK(rc)) {
+        Tcl_WideInt rows = connPtr->blockFetch ? (Tcl_WideInt)connPtr->rowsFetched : 1;
 
-    rc = SQLDisconnect(hdbc);
-    if (!RC_OK(rc)) {
-        return NS_ERROR;
-    }
-    rc = SQLFreeConnect(hdbc);
-    if (!RC_OK(rc)) {
-        return NS_ERROR;
+        connPtr->stats.rows += rows;
+        connPtr->stmtRows += rows;
     }
-    return NS_OK;
+
+    return rc;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * ODBCExec -
+ * ODBCFetch -
  *
- *	Send an SQL statement.
+ *	Advance to the next row of the active select. In block-cursor
+ *	mode, the row is taken from the current rowset, and a new rowset
+ *	is fetched when all rows of the current one were returned.
  *
  * Results:
- *	NS_DML, NS_ROWS, or NS_ERROR.
+ *	NS_OK, NS_END_DATA or NS_ERROR.
  *
  * Side effects:
- *	Database may be modified or rows may be waiting.
+ *	The statement is freed at the end of the data or on error.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-ODBCExec(Ns_DbHandle *handle, const char *sql)
+static Ns_ReturnCode
+ODBCFetch(Ns_DbHandle *handle)
 {
-    HSTMT           hstmt;
-    RETCODE         rc;
-    int             status = NS_OK;
-    short           numcols;
-
-    /*
-     * Allocate a new statement.
-     */
-
-    rc = SQLAllocStmt((SQLHDBC) handle->connection, &hstmt);
-    ODBCLog(rc, handle);
-    if (!RC_OK(rc)) {
-        return NS_ERROR;
-    }
+    OdbcConn       *connPtr = handle->connection;
+    SQLRETURN       rc;
 
-    /*
-     * Send the SQL and determine if rows are available.
-     */
-
-    handle->statement = hstmt;
-    rc = SQLExecDirect(hstmt, (SQLCHAR *)sql, SQL_NTS);
-    ODBCLog(rc, handle);
-    if (RC_OK(rc)) {
-        rc = SQLNumResultCols(hstmt, &numcols);
+    if (connPtr->blockFetch && connPtr->rowIndex < connPtr->rowsFetched) {
+        rc = SQL_SUCCESS;
+    } else {
+        rc = ODBCSQLFetch(handle);
         ODBCLog(rc, handle);
-        if (RC_OK(rc)) {
-            if (numcols != 0) {
-                handle->fetchingRows = 1;
-                status = NS_ROWS;
-            } else {
-                status = NS_DML;
-            }
-        }
+        connPtr->rowIndex = 0u;
     }
-
-    /*
-     * Free the statement unless rows are waiting.
-     */
-
-    if (!RC_OK(rc)) {
-        status = NS_ERROR;
+    if (rc == SQL_NO_DATA_FOUND) {
+        ODBCFreeStmt(handle);
+        return NS_END_DATA;
     }
-    if (status != NS_ROWS && ODBCFreeStmt(handle) != NS_OK) {
-        status = NS_ERROR;
+    if (connPtr->blockFetch && RC_OK(rc)
+        && connPtr->rowStatus[connPtr->rowIndex++] == SQL_ROW_ERROR) {
+        Ns_Log(Error, "%s[%s]: error in fetched row",
+               handle->driver, handle->poolname);
+        rc = SQL_ERROR;
     }
-    return status;
+    if (!RC_OK(rc)) {
+        ODBCFreeStmt(handle);
+        return NS_ERROR;
+    }
+    return NS_OK;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * ODBCBindRow -
+ * ODBCColumnValue -
  *
- *	Bind row after an ODBCExec which returned NS_ROWS.
+ *	Get the value of column "i" of the current row as a string: from
+ *	the rowset buffers in block-cursor mode, or with SQLGetData
+ *	otherwise.
  *
  * Results:
- *	NS_OK or NS_ERROR.
+ *	NS_TRUE on success. The value (NULL for SQL NULL) and its length
+ *	are returned in valuePtr and lengthPtr; the value is valid until
+ *	the next call.
  *
  * Side effects:
- *	Given Ns_Set is modified with column names.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static Ns_Set *
-ODBCBindRow(Ns_DbHandle *handle)
+static bool
+ODBCColumnValue(Ns_DbHandle *handle, SQLUSMALLINT i, const char **valuePtr,
+                SQLLEN *lengthPtr)
 {
-    HSTMT           hstmt;
-    RETCODE         rc;
-    Ns_Set         *row;
-    short           numcols;
-    SQLUSMALLINT    i;
-    char            colname[100];
-    short           cbcolname;
-    SWORD           sqltype, ibscale, nullable;
-    SQLULEN         cbcoldef;
-
-    if (!handle->fetchingRows) {
-        Ns_Log(Error, "%s[%s]: no waiting rows",
-               handle->driver, handle->poolname);
-        return NULL;
-    }
-    row = handle->row;
-    hstmt = (HSTMT) handle->statement;
-    rc = SQLNumResultCols(hstmt, &numcols);
-    for (i = 1; RC_OK(rc) && i <= numcols; i++) {
-        rc = SQLDescribeCol(hstmt, i,
-                            (SQLCHAR *)colname, sizeof(colname),
-                            &cbcolname, &sqltype, &cbcoldef, &ibscale, &nullable);
-        ODBCLog(rc, handle);
-        if (RC_OK(rc)) {
-            Ns_SetPut(row, colname, NULL);
+    OdbcConn         *connPtr = handle->connection;
+    const OdbcColumn *colPtr = &connPtr->columns[i];
+    Ns_Time           start;
+    SQLRETURN         rc;
+
+    if (connPtr->blockFetch) {
+        SQLULEN rowIndex = connPtr->rowIndex - 1u;
+        SQLLEN  cbvalue = colPtr->lengths[rowIndex];
+
+        if (cbvalue == SQL_NULL_DATA) {
+            *valuePtr = NULL;
+            *lengthPtr = 0;
+        } else if (cbvalue == SQL_NO_TOTAL || cbvalue >= colPtr->width) {
+            Ns_Log(Error, "%s[%s]: value of column '%s' truncated",
+                   handle->driver, handle->poolname, colPtr->name);
+            return NS_FALSE;
+        } else {
+            *valuePtr = (char *)colPtr->data + rowIndex * (SQLULEN)colPtr->width;
+            *lengthPtr = cbvalue;
+            connPtr->stats.bytes += cbvalue;
         }
+        return NS_TRUE;
     }
-    if (!RC_OK(rc)) {
-        ODBCFreeStmt(handle);
-        row = NULL;
-    }
-    return row;
+
+    Ns_GetTime(&start);
+    rc = ODBCGetData(handle, i, SQL_C_CHAR, valuePtr, lengthPtr);
+    ODBCPhaseDone(connPtr, ODBC_PHASE_GETDATA, &start);
+
+    return RC_OK(rc);
 }
 
 
@@ -889,7 +7592,7 @@ ODBCBindRow(Ns_DbHandle *handle)
  *	Fetch the next row.
  *
  * Results:
- *	NS_OK or NS_ERROR.
+ *	NS_OK, NS_END_DATA or NS_ERROR.
  *
  * Side effects:
  *	Given Ns_Set is modified with new values.
@@ -900,52 +7603,37 @@ ODBCBindRow(Ns_DbHandle *handle)
 static int
 ODBCGetRow(Ns_DbHandle *handle, Ns_Set *row)
 {
-    SQLRETURN           rc1;
-    SQLRETURN           rc2 = 0;
-    SQLCHAR            *datum;
     SQLUSMALLINT        i;
-    SQLHSTMT            hstmt;
-    SQLSMALLINT         mdknumcols;
     SQLLEN		cbvalue;
+    Ns_ReturnCode       status;
+    const OdbcConn     *connPtr;
 
     if (!handle->fetchingRows) {
         Ns_Log(Error, "%s[%s]: no waiting rows",
                handle->driver, handle->poolname);
         return NS_ERROR;
     }
-    hstmt = (SQLHSTMT) handle->statement;
-    rc1 = SQLNumResultCols(hstmt, &mdknumcols);
-    ODBCLog(rc1, handle);
-    datum = (SQLCHAR*)ns_malloc(4096);
-    if (!RC_OK(rc1)) {
-        goto error;
-    }
-    if (mdknumcols != (SQLSMALLINT)Ns_SetSize(row)) {
+    connPtr = handle->connection;
+    if (connPtr->numCols != (SQLSMALLINT)Ns_SetSize(row)) {
         Ns_Log(Error, "%s[%s]: mismatched number of rows",
                handle->driver, handle->poolname);
-        goto error;
-    }
-    rc2 = SQLFetch(hstmt);
-    ODBCLog(rc2, handle);
-    if (rc2 == SQL_NO_DATA_FOUND) {
         ODBCFreeStmt(handle);
-        return NS_END_DATA;
+        return NS_ERROR;
     }
-    for (i = 1; RC_OK(rc2) && i <= mdknumcols; i++) {
 
-        rc2 = SQLGetData(hstmt, i, SQL_C_CHAR, (SQLPOINTER)datum, 4096, &cbvalue);
-        ODBCLog(rc2, handle);
-        if (RC_OK(rc2)) {
-            Ns_SetPutValue(row, i - 1, cbvalue == SQL_NULL_DATA ? "" : (char*)datum);
-        }
+    status = ODBCFetch(handle);
+    if (status != NS_OK) {
+        return status;
     }
-    if (!RC_OK(rc2)) {
-error:
-        ODBCFreeStmt(handle);
-        ns_free(datum);
-        return NS_ERROR;
+    for (i = 0u; i < (SQLUSMALLINT)connPtr->numCols; i++) {
+        const char *value;
+
+        if (!ODBCColumnValue(handle, i, &value, &cbvalue)) {
+            ODBCFreeStmt(handle);
+            return NS_ERROR;
+        }
+        Ns_SetPutValue(row, i, value == NULL ? "" : value);
     }
-        ns_free(datum);
     return NS_OK;
 }
 
@@ -982,6 +7670,108 @@ ODBCCancel(Ns_DbHandle *handle)
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCTypeName -
+ *
+ *	Return a readable name of an ODBC SQL data type.
+ *
+ * Results:
+ *	Pointer to static string.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+ODBCTypeName(SQLSMALLINT sqlType)
+{
+    switch (sqlType) {
+    case SQL_CHAR:           return "char";
+    case SQL_VARCHAR:        return "varchar";
+    case SQL_LONGVARCHAR:    return "longvarchar";
+    case SQL_WCHAR:          return "wchar";
+    case SQL_WVARCHAR:       return "wvarchar";
+    case SQL_WLONGVARCHAR:   return "wlongvarchar";
+    case SQL_DECIMAL:        return "decimal";
+    case SQL_NUMERIC:        return "numeric";
+    case SQL_SMALLINT:       return "smallint";
+    case SQL_INTEGER:        return "integer";
+    case SQL_REAL:           return "real";
+    case SQL_FLOAT:          return "float";
+    case SQL_DOUBLE:         return "double";
+    case SQL_BIT:            return "bit";
+    case SQL_TINYINT:        return "tinyint";
+    case SQL_BIGINT:         return "bigint";
+    case SQL_BINARY:         return "binary";
+    case SQL_VARBINARY:      return "varbinary";
+    case SQL_LONGVARBINARY:  return "longvarbinary";
+    case SQL_TYPE_DATE:      return "date";
+    case SQL_TYPE_TIME:      return "time";
+    case SQL_TYPE_TIMESTAMP: return "timestamp";
+    case SQL_GUID:           return "guid";
+    default:                 return "unknown";
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ODBCColumnsObj -
+ *
+ *	Build a Tcl list describing the columns of the current (or last)
+ *	result set of a handle. Every element is a dict with the keys
+ *	name, type, sqltype, size, scale and nullable.
+ *
+ * Results:
+ *	New Tcl_Obj with refcount 0.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ODBCColumnsObj(const OdbcConn *connPtr)
+{
+    Tcl_Obj     *listObj = Tcl_NewListObj(0, NULL);
+    SQLSMALLINT  i;
+
+    for (i = 0; i < connPtr->numCols; i++) {
+        const OdbcColumn *colPtr = &connPtr->columns[i];
+        Tcl_Obj          *dictObj = Tcl_NewDictObj();
+        const char       *nullable;
+
+        if (colPtr->nullable == SQL_NULLABLE) {
+            nullable = "1";
+        } else if (colPtr->nullable == SQL_NO_NULLS) {
+            nullable = "0";
+        } else {
+            nullable = "unknown";
+        }
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("name", 4),
+                       Tcl_NewStringObj(colPtr->name, -1));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("type", 4),
+                       Tcl_NewStringObj(ODBCTypeName(colPtr->sqlType), -1));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("sqltype", 7),
+                       Tcl_NewIntObj(colPtr->sqlType));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("size", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt)colPtr->size));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("scale", 5),
+                       Tcl_NewIntObj(colPtr->scale));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("nullable", 8),
+                       Tcl_NewStringObj(nullable, -1));
+        Tcl_ListObjAppendElement(NULL, listObj, dictObj);
+    }
+    return listObj;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1006,6 +7796,39 @@ ODBCCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const char
     char            buf[MAX_IDENTIFIER];
     SWORD FAR       cbInfoValue;
 
+    if (argc >= 2 && STREQ(argv[1], "query")) {
+        return ODBCQueryCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "foreach")) {
+        return ODBCForeachCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "json")) {
+        return ODBCJsonCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "copyout")) {
+        return ODBCCopyOutCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "load")) {
+        return ODBCLoadCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "exec")) {
+        return ODBCAsyncExecCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "wait")) {
+        return ODBCAsyncWaitCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "parallel")) {
+        return ODBCParallelCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "timeout")) {
+        return ODBCTimeoutCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "transaction")) {
+        return ODBCTransactionCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "stats")) {
+        return ODBCStatsCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "alive")) {
+        return ODBCAliveCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "cache")) {
+        return ODBCCacheCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "route")) {
+        return ODBCRouteCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "results")) {
+        return ODBCResultsCmd(interp, argc, argv);
+    } else if (argc >= 2 && STREQ(argv[1], "slowqueries")) {
+        return ODBCSlowQueriesCmd(interp, argc, argv);
+    }
     if (argc != 3) {
         Tcl_AppendResult(interp, "wrong # args: should be \"",
             argv[0], " cmd handle\"", NULL);
@@ -1031,22 +7854,25 @@ ODBCCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const char
     }
 
     if (STREQ(argv[1], "dbmsname")) {
-        rc = SQLGetInfo((SQLHDBC) handle->connection, SQL_DBMS_NAME, buf, sizeof(buf), &cbInfoValue);
+        rc = SQLGetInfo(((OdbcConn *) handle->connection)->hdbc, SQL_DBMS_NAME, buf, sizeof(buf), &cbInfoValue);
         ODBCLog(rc, handle);
         if (!RC_OK(rc)) {
             Tcl_SetObjResult(interp, Tcl_NewStringObj("could not determine dbmsname", -1));
             return TCL_ERROR;
         }
     } else if (STREQ(argv[1], "dbmsver")) {
-        rc = SQLGetInfo((SQLHDBC) handle->connection, SQL_DBMS_VER, buf, sizeof(buf), &cbInfoValue);
+        rc = SQLGetInfo(((OdbcConn *) handle->connection)->hdbc, SQL_DBMS_VER, buf, sizeof(buf), &cbInfoValue);
         ODBCLog(rc, handle);
         if (!RC_OK(rc)) {
             Tcl_SetObjResult(interp, Tcl_NewStringObj("could not determine dbmsver", -1));
             return TCL_ERROR;
         }
+    } else if (STREQ(argv[1], "columns")) {
+        Tcl_SetObjResult(interp, ODBCColumnsObj(handle->connection));
+        return TCL_OK;
     } else {
         Tcl_AppendResult(interp, "unknown command \"", argv[1],
-            "\": should be dbmsname or dbmsver.", NULL);
+            "\": should be alive, cache, columns, copyout, dbmsname, dbmsver, exec, foreach, json, load, parallel, query, results, route, slowqueries, stats, timeout, transaction or wait.", NULL);
         return TCL_ERROR;
     }
 
@@ -1074,6 +7900,7 @@ ODBCCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, int argc, const char
 static void
 ODBCLog(RETCODE rc, Ns_DbHandle *handle)
 {
+    SQLHENV         henv;
     SQLHDBC         hdbc;
     SQLHSTMT        hstmt;
     Ns_LogSeverity  severity;
@@ -1089,9 +7916,15 @@ ODBCLog(RETCODE rc, Ns_DbHandle *handle)
     } else {
         return;
     }
-    hdbc = (SQLHDBC) handle->connection;
+    if (handle->connection != NULL) {
+        hdbc = ((OdbcConn *) handle->connection)->hdbc;
+        henv = ((OdbcConn *) handle->connection)->poolPtr->envPtr->henv;
+    } else {
+        hdbc = NULL;
+        henv = sharedEnv.henv;
+    }
     hstmt = (SQLHSTMT) handle->statement;
-    while (SQLError(odbcenv, hdbc, hstmt, szSQLSTATE, &nErr, msg, sizeof(msg), &cbmsg)
+    while (SQLError(henv, hdbc, hstmt, szSQLSTATE, &nErr, msg, sizeof(msg), &cbmsg)
            == SQL_SUCCESS) {
         Ns_Log(severity, "%s[%s]: odbc message: "
                "SQLSTATE = %s, Native err = %d, msg = '%s'",
@@ -1100,6 +7933,34 @@ ODBCLog(RETCODE rc, Ns_DbHandle *handle)
         Ns_DStringFree(&(handle->dsExceptionMsg));
         Ns_DStringAppend(&(handle->dsExceptionMsg), (const char *)msg);
     }
+
+    /*
+     * Report statements cancelled by the watchdog like statements
+     * timed out by the driver.
+     */
+    if (rc == SQL_ERROR && handle->connection != NULL
+        && ((OdbcConn *) handle->connection)->watchTimeout > 0) {
+        bool timedOut;
+
+        Ns_MutexLock(&watchdog.lock);
+        timedOut = ((OdbcConn *) handle->connection)->timedOut;
+        Ns_MutexUnlock(&watchdog.lock);
+        if (timedOut) {
+            strcpy(handle->cExceptionCode, "HYT00");
+            Ns_DStringFree(&(handle->dsExceptionMsg));
+            Ns_DStringAppend(&(handle->dsExceptionMsg), "Query timeout expired");
+        }
+    }
+    if (rc == SQL_ERROR && handle->connection != NULL) {
+        OdbcConn      *connPtr = handle->connection;
+        Tcl_HashEntry *hPtr;
+        int            isNew;
+
+        hPtr = Tcl_CreateHashEntry(&connPtr->stats.errors,
+                                   handle->cExceptionCode[0] != '\0' ?
+                                   handle->cExceptionCode : "HY000", &isNew);
+        Tcl_SetHashValue(hPtr, INT2PTR(PTR2INT(Tcl_GetHashValue(hPtr)) + 1));
+    }
 }
 
 /*
@@ -1121,11 +7982,40 @@ ODBCLog(RETCODE rc, Ns_DbHandle *handle)
 static int
 ODBCFreeStmt(Ns_DbHandle *handle)
 {
-    RETCODE rc;
-
-    rc = SQLFreeStmt((SQLHSTMT) handle->statement, SQL_DROP);
+    RETCODE   rc;
+    OdbcConn *connPtr = handle->connection;
+    SQLHSTMT  hstmt = (SQLHSTMT) handle->statement;
+    Ns_Time   start;
+
+    ODBCUnwatchStmt(connPtr);
+    connPtr->watchStmt = NULL;
+    connPtr->watchTimeout = 0;
+    Ns_GetTime(&start);
+    if (connPtr->stmtPtr != NULL) {
+        /*
+         * Keep cached statements prepared, just close the cursor and
+         * undo the bindings of this execution.
+         */
+        rc = SQLFreeStmt(hstmt, SQL_CLOSE);
+        if (connPtr->blockFetch) {
+            (void) SQLFreeStmt(hstmt, SQL_UNBIND);
+            (void) SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)1, 0);
+            (void) SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_STATUS_PTR, NULL, 0);
+            (void) SQLSetStmtAttr(hstmt, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+        }
+        (void) SQLFreeStmt(hstmt, SQL_RESET_PARAMS);
+        connPtr->stmtPtr = NULL;
+    } else {
+        rc = ODBCDropHstmt(connPtr, hstmt);
+    }
+    ODBCPhaseDone(connPtr, ODBC_PHASE_FREE, &start);
+    if (connPtr->timing) {
+        connPtr->timing = NS_FALSE;
+        ODBCLogSlowQuery(handle);
+    }
     handle->statement = NULL;
     handle->fetchingRows = 0;
+    ODBCResetColumns(connPtr);
     if (!RC_OK(rc)) {
         return NS_ERROR;
     }
@@ -1,4 +1,289 @@
-typedef struct _string_list_elt {
-	  char *string;
-	    struct _string_list_elt *next;
-} string_list_elt_t;
+/*
+ * Parsed form of an SQL string with bind variables: numVars + 1 fragments
+ * of "text", separated by the bind variables "varNames". Templates are
+ * immutable and may be shared between threads.
+ */
+
+typedef struct OdbcFragment {
+    size_t        offset;
+    size_t        length;
+} OdbcFragment;
+
+typedef struct OdbcTemplate {
+    const char    *text;
+    OdbcFragment  *fragments;
+    const char   **varNames;
+    int            numVars;
+    bool           cached;
+} OdbcTemplate;
+
+/*
+ * Performance statistics: per phase of statement processing the number
+ * of calls, total and maximum time, and a histogram of the times with
+ * power of two buckets (bucket i counts times below 2^i microseconds).
+ * Statistics are collected per handle without locking and merged into
+ * the pool statistics when the handle is returned to the pool.
+ */
+
+#define ODBC_HIST_BUCKETS 32
+
+typedef enum {
+    ODBC_PHASE_ALLOCATE,
+    ODBC_PHASE_EXECUTE,
+    ODBC_PHASE_DESCRIBE,
+    ODBC_PHASE_FETCH,
+    ODBC_PHASE_GETDATA,
+    ODBC_PHASE_FREE,
+    ODBC_PHASES
+} OdbcPhase;
+
+typedef struct OdbcPhaseStats {
+    Tcl_WideInt   count;
+    Tcl_WideInt   totalUs;
+    Tcl_WideInt   maxUs;
+    Tcl_WideInt   histogram[ODBC_HIST_BUCKETS];
+} OdbcPhaseStats;
+
+typedef struct OdbcStats {
+    OdbcPhaseStats phases[ODBC_PHASES];
+    Tcl_WideInt   rows;
+    Tcl_WideInt   bytes;
+    Tcl_WideInt   reconnects;     /* After dead connections or link failures */
+    Tcl_WideInt   failedReconnects;
+    Tcl_WideInt   retries;        /* Reads retried after a link failure */
+    Tcl_HashTable errors;         /* Number of errors by SQLSTATE */
+} OdbcStats;
+
+/*
+ * ODBC environment, shared by all pools or owned by a pool with
+ * "environment" enabled. The calls which go through the environment in
+ * the driver manager (connecting and allocating and freeing statements)
+ * are counted, including those started while another one was in
+ * progress, as a measure of contention.
+ */
+
+typedef struct OdbcEnv {
+    SQLHENV       henv;
+    Tcl_WideInt   active;         /* Calls in progress */
+    Tcl_WideInt   maxActive;
+    Tcl_WideInt   calls;
+    Tcl_WideInt   contended;      /* Calls started while others were in progress */
+    Tcl_WideInt   totalUs;
+    Tcl_WideInt   maxUs;
+} OdbcEnv;
+
+/*
+ * Aggregated timings of the statements with the same fingerprint which
+ * were logged by the slow query log.
+ */
+
+typedef struct OdbcSlowQuery {
+    Tcl_WideInt   count;
+    Tcl_WideInt   totalUs;
+    Tcl_WideInt   maxUs;
+    Tcl_WideInt   rows;
+} OdbcSlowQuery;
+
+/*
+ * Per-pool settings of the driver, read once from the pool section
+ * "ns/db/pool/$pool" of the configuration file.
+ */
+
+typedef struct OdbcPool {
+    const char   *name;
+    OdbcEnv      *envPtr;
+    SQLULEN       rowsetSize;     /* Rows per SQLFetch in block-cursor mode */
+    SQLLEN        maxBindSize;    /* Widest column bound in block-cursor mode */
+    bool          nativeBind;     /* Pass ns_odbc_bind values as parameters */
+    int           stmtCacheSize;  /* Max. prepared statements per handle */
+    int           batchSize;      /* Rows per SQLExecute in batch DML */
+    int           queryTimeout;   /* Default statement timeout in seconds */
+    int           connections;    /* Handles of the pool */
+    int           warmup;         /* Handles opened at startup */
+    int           numInitSql;
+    const char  **initSql;        /* Run once per connection */
+    Ns_Time       slowQueryTime;  /* Log statements taking longer */
+    int           slowQuerySample; /* Also log 1 of n faster statements */
+    Ns_Mutex      lock;           /* Protects stats and slowQueries */
+    OdbcStats     stats;
+    Tcl_HashTable slowQueries;    /* OdbcSlowQuery by fingerprint */
+} OdbcPool;
+
+/*
+ * Logical pool of the driver section "ns/db/driver/$driver/route/$name":
+ * writes go to "writePool", reads to one of the "readPools", picked by
+ * weight, except in the sticky window after a write of the same request.
+ */
+
+typedef struct OdbcRoute {
+    const char   *name;
+    int           index;          /* In the per-thread sticky windows */
+    const char   *writePool;
+    int           numReadPools;
+    const char  **readPools;
+    int          *weights;
+    int           totalWeight;
+    Ns_Time       stickyTime;
+} OdbcRoute;
+
+/*
+ * Per-thread end of the sticky window of a route after a write.
+ */
+
+typedef struct OdbcSticky {
+    uintptr_t     connId;         /* Request of the write, 0 outside of requests */
+    Ns_Time       until;
+} OdbcSticky;
+
+/*
+ * Value of a "?" placeholder, passed with SQLBindParameter.
+ */
+
+typedef struct OdbcParam {
+    const char   *value;
+    SQLLEN        length;
+} OdbcParam;
+
+/*
+ * Column of the current result set. The buffers live in the arena of the
+ * handle. In block-cursor mode, "data" points to "rowsetSize" values of
+ * "width" bytes each, "lengths" to the corresponding length/indicator
+ * values; otherwise, to a single value.
+ */
+
+typedef struct OdbcColumn {
+    const char   *name;
+    SQLSMALLINT   sqlType;
+    SQLULEN       size;
+    SQLSMALLINT   scale;
+    SQLSMALLINT   nullable;
+    SQLLEN        width;
+    SQLCHAR      *data;
+    SQLLEN       *lengths;
+} OdbcColumn;
+
+/*
+ * Prepared statement in the per-handle statement cache.
+ */
+
+typedef struct OdbcStmt {
+    SQLHSTMT         hstmt;
+    Tcl_HashEntry   *hPtr;        /* Entry in OdbcConn.stmts */
+    struct OdbcStmt *prevPtr;     /* LRU list, most recently used first */
+    struct OdbcStmt *nextPtr;
+} OdbcStmt;
+
+/*
+ * Driver specific part of an Ns_DbHandle, kept in handle->connection.
+ */
+
+typedef struct OdbcConn {
+    SQLHDBC       hdbc;
+    OdbcPool     *poolPtr;
+    OdbcColumn   *columns;        /* Descriptor of the current result set */
+    SQLSMALLINT   numCols;
+    SQLSMALLINT   maxCols;        /* Allocated size of columns */
+    Ns_DString    dsNames;        /* Column names, NUL separated */
+    OdbcParam    *params;         /* Parameters for the next ODBCExec */
+    int           numParams;
+    int           maxParams;
+    bool          blockFetch;
+    SQLULEN       rowsFetched;
+    SQLULEN       rowIndex;
+    SQLUSMALLINT *rowStatus;
+    char         *arena;          /* Column buffers, reused across results */
+    size_t        arenaSize;
+    Ns_DString    dsValue;        /* Values longer than the column buffer */
+    Tcl_HashTable stmts;          /* Statement cache, keyed by normalized SQL */
+    OdbcStmt     *lruHead;
+    OdbcStmt     *lruTail;
+    int           numStmts;
+    OdbcStmt     *stmtPtr;        /* Cached statement in use, or NULL */
+    Ns_DString    dsKey;
+    int           queryTimeout;   /* Override of the pool default, or -1 */
+    Ns_DbHandle  *handle;
+    int           watchTimeout;   /* Query timeout of the current statement */
+    bool          watched;        /* Call is in the watchdog list */
+    bool          timedOut;       /* Call was cancelled by the watchdog */
+    Ns_Time       deadline;
+    SQLHSTMT      watchStmt;
+    struct OdbcConn *watchPrevPtr;
+    struct OdbcConn *watchNextPtr;
+    OdbcStats     stats;          /* Not yet merged into the pool */
+    bool          timing;         /* Current statement is timed for the slow query log */
+    Ns_Time       stmtStart;
+    Tcl_WideInt   execUs;
+    Tcl_WideInt   fetchUs;
+    Tcl_WideInt   stmtRows;
+    Ns_DString    dsSql;
+    bool          inTransaction;  /* Autocommit is off, see "ns_odbc transaction" */
+    bool          reconnecting;   /* Running "initsql" in ODBCReconnect */
+} OdbcConn;
+
+/*
+ * Output buffer of "ns_odbc copyout", flushed to a Tcl channel or to the
+ * current connection whenever it is full.
+ */
+
+#define ODBC_COPY_BUFSIZE 65536
+
+typedef struct OdbcWriter {
+    Tcl_Channel   chan;
+    Ns_Conn      *conn;
+    size_t        length;
+    bool          failed;
+    char          buf[ODBC_COPY_BUFSIZE];
+} OdbcWriter;
+
+/*
+ * Statement run by the driver worker threads for "ns_odbc exec -async".
+ * The result is kept as C data until it is collected by "ns_odbc wait":
+ * "result" holds the column names followed by the values of all rows,
+ * each NUL terminated, or the error message.
+ */
+
+typedef struct OdbcJob {
+    struct OdbcJob *nextPtr;          /* Queue of pending jobs */
+    Tcl_HashEntry  *hPtr;             /* Entry in the jobs table */
+    const char     *server;
+    char           *pool;
+    char           *sql;
+    char           *script;           /* Completion callback, or NULL */
+    bool            done;
+    Ns_Time         expires;          /* Dropped when not collected by then */
+    int             status;           /* TCL_OK or TCL_ERROR */
+    char            exceptionCode[6];
+    int             numCols;
+    Tcl_WideInt     numRows;
+    Ns_DString      result;
+} OdbcJob;
+
+/*
+ * Query of "ns_odbc_bind 1row|0or1row -coalesce" in progress. Callers of
+ * the same query wait for its completion and take copies of the row or
+ * the error message; the last one frees it.
+ */
+
+typedef struct OdbcFlight {
+    Ns_Cond       cond;           /* Signaled when done */
+    int           waiters;
+    bool          done;
+    int           result;         /* TCL_OK or TCL_ERROR */
+    int           nrows;
+    Ns_Set       *rowPtr;
+    Ns_DString    error;
+} OdbcFlight;
+
+/*
+ * Statements of "ns_odbc parallel", taken in order by the threads
+ * running them, one per handle.
+ */
+
+typedef struct OdbcParallel {
+    Ns_Mutex      lock;
+    OdbcJob      *jobs;
+    int           numJobs;
+    int           nextJob;
+    Ns_DbHandle **handles;
+    int           nextHandle;
+} OdbcParallel;
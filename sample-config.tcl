@@ -13,19 +13,51 @@ ns_param   defaultpool     mypool    ;# Optionally specify default pool
 ns_param   pools           mypool    ;# Optionally specify list of pools
 
 #
-# The "param" config item serves no purpose.  It is a placeholder.
+# Settings shared by all pools of the driver.
 #
 ns_section "ns/db/driver/nsrbodbc"
-ns_param   param           ""
+ns_param   templatecachesize 1000    ;# Parsed ns_odbc_bind statements kept server-wide
+ns_param   asyncthreads    4         ;# Worker threads for "ns_odbc exec -async"
+ns_param   asyncresulttimeout 5m     ;# Uncollected results of async jobs are dropped after this time
+ns_param   resultcachesize 10MB      ;# Size of the cache of "ns_odbc_bind 1row -cache"
+ns_param   routes          ""        ;# Logical pools for read/write routing, e.g. "main"
+ns_param   connectionpooling off     ;# Driver manager connection pooling: off, driver or environment
+
+#
+# Route "main" (enable it with "routes main" above): writes to the pool
+# "primary", reads spread over the pools "replica1" and "replica2" with
+# weights 2:1. The replicas must be copies of the primary kept up to
+# date by the database's replication. To try routing locally without
+# replication, let all three pools use the same database, e.g. with the
+# odbc.ini entry
+#
+#   [nsodbc-test]
+#   Driver   = SQLite3
+#   Database = /tmp/nsodbc-test.db
+#
+ns_section "ns/db/driver/nsrbodbc/route/main"
+ns_param   writepool       primary   ;# Pool for "ns_odbc_bind dml"
+ns_param   readpools       {replica1 2 replica2 1} ;# Pools for 1row/0or1row, each with optional weight
+ns_param   stickytime      5s        ;# Reads go to the write pool after a write in the same request
+
+foreach pool {primary replica1 replica2} {
+    ns_section "ns/db/pool/$pool"
+    ns_param   driver      nsrbodbc
+    ns_param   datasource  nsodbc-test ;# Same database for all three pools
+    ns_param   connections 2
+}
 
 # Specify the name of the database pool here.
 ns_section "ns/db/pools"
 ns_param   mypool          "Red Brick database pool"
+ns_param   primary         "Write pool of route main"
+ns_param   replica1        "Read pool of route main"
+ns_param   replica2        "Read pool of route main"
 
 # Describe the pool in detail here.  This section depends on the db driver.
 ns_section "ns/db/pool/mypool"
 ns_param   driver          nsrbodbc    ;# From "ns/db/drivers" list
-ns_param   datasource      "whatever"  ;# I hope *you* know what this should be
+ns_param   datasource      "whatever"  ;# DSN, or connection string like "Driver=SQLite3;Database=/tmp/x.db"
 ns_param   user            "username"  ;# Username for database
 ns_param   password        "userpass"  ;# Password for database
 ns_param   connections     1         ;# No. of connections to open
@@ -33,6 +65,19 @@ ns_param   logsqlerrors    true      ;# Verbose SQL query error logging
 ns_param   maxidle         600       ;# Max time to keep idle db conn open
 ns_param   maxopen         3600      ;# Max time to keep active db conn open
 ns_param   verbose         true      ;# Verbose error logging
+ns_param   rowsetsize      1         ;# Rows per fetch; >1 enables block cursors
+ns_param   maxbindsize     8192      ;# Largest column buffer in bytes, longer values are fetched in chunks
+ns_param   nativebind      false     ;# Pass ns_odbc_bind values via SQLBindParameter
+ns_param   stmtcachesize   0         ;# Prepared statements kept per handle (LRU)
+ns_param   batchsize       1000      ;# Rows per execution in "ns_odbc_bind batchdml"
+ns_param   querytimeout    0         ;# Statement timeout in seconds (0: none), see "ns_odbc timeout"
+ns_param   gethandletimeout 30s      ;# Max. wait for a handle of commands given a pool name
+ns_param   slowquerytime   0s        ;# Log statements taking longer (0s: off), see "ns_odbc slowqueries"
+ns_param   slowquerysample 0         ;# Also log about 1 of n other statements (0: none)
+ns_param   environment     false     ;# Own ODBC 3 environment instead of the shared ODBC 2 one
+ns_param   cpmatch         strict    ;# Match of pooled connections (own environment): strict or relaxed
+ns_param   warmup          0         ;# Handles opened in parallel at startup (max. "connections")
+ns_param   initsql         {}        ;# List of statements run once per new connection, e.g. {{set search_path to app}}
 
 
 # Tell the virtual server about the pools it can use.